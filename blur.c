@@ -22,14 +22,755 @@
  */
 
 #include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include "blur.h"
+#include "parallel.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Number of threads to blur with, 0 means one per CPU. */
+extern int blur_threads;
+
+/* Smallest sigma (in pixels of the shrunk image) to keep when blurring large
+ * sigmas at a lower resolution, 0 always blurs at full resolution. */
+extern int blur_quality;
+
+/* Which filter blur_image_surface() applies. */
+extern blur_mode_t blur_mode;
+
+/* shrink by at most 2^MAX_DOWNSCALE_STEPS in each direction */
+#define MAX_DOWNSCALE_STEPS 3
+
+/* Images are blurred in bands of rows, so that the intermediate buffers need
+ * about this much memory regardless of the image height. */
+#define BAND_BUFFER_BYTES (16 << 20)
+
+/* the Gaussian kernel is cut off at this many sigmas */
+#define GAUSS_CUTOFF 3
+
+/* Below this sigma three boxes are only a few pixels wide and look nothing
+ * like a Gaussian (at sigma 1, a single 3 pixel box is off by up to 53/255),
+ * so the box mode uses the Gaussian kernel instead. It is as fast there. */
+#define BOX_MIN_SIGMA 3
+
+/* dual filter blurs halve the image at most this many times */
+#define MAX_KAWASE_LEVELS 8
+/* The dual filter levels blur at most this share of sigma squared, the rest
+ * is a Gaussian on the smallest level. Deeper levels alias more: with all of
+ * it, --blur-bench shows errors of up to 17/255 at sigma 2 and 22/255 at
+ * sigma 20, with a third at most 12/255 and mean errors of 0.3-0.5. */
+#define KAWASE_SHARE (1.0 / 3)
+
+typedef void (*box_pass_fn)(const uint32_t *src, int src_stride, uint32_t *dst, int dst_stride,
+                            int width, int height, int radius, const int *index, int row_start, int row_end);
+
+typedef void (*gauss_pass_fn)(const uint32_t *src, int src_stride, uint32_t *dst, int dst_stride,
+                              int width, int height, int radius, const int *index, const int16_t *weights,
+                              int row_start, int row_end);
+
+typedef void (*kawase_down_fn)(const uint32_t *above, const uint32_t *top, const uint32_t *bottom,
+                               const uint32_t *below, uint32_t *out, int start, int end);
+
+typedef void (*kawase_up_fn)(const uint32_t *near, const uint32_t *far, uint32_t *out, int start, int end);
+
+/* Picks the widest box pass kernel the CPU supports. */
+static box_pass_fn select_box_pass(void) {
+#ifdef BLUR_X86_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return blur_impl_box_pass_avx2;
+#endif
+#ifdef __SSE2__
+    return blur_impl_box_pass_sse2;
+#else
+    return blur_impl_box_pass_generic;
+#endif
+}
+
+/* Picks the widest Gaussian pass kernel the CPU supports. */
+static gauss_pass_fn select_gauss_pass(void) {
+#ifdef BLUR_X86_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return blur_impl_gauss_pass_avx2;
+#endif
+#ifdef __SSE2__
+    return blur_impl_gauss_pass_sse2;
+#else
+    return blur_impl_gauss_pass_generic;
+#endif
+}
+
+/* Picks the widest dual filter kernels the CPU supports. */
+static void select_kawase(kawase_down_fn *down, kawase_up_fn *up) {
+#ifdef __SSE2__
+    *down = blur_impl_kawase_down_sse2;
+    *up = blur_impl_kawase_up_sse2;
+#else
+    *down = blur_impl_kawase_down_generic;
+    *up = blur_impl_kawase_up_generic;
+#endif
+}
+
+/*
+ * A separable filter: BOX_PASSES box passes with the given radii, or, if
+ * gauss_pass is set, one Gaussian pass with the given weights, in each
+ * direction.
+ */
+typedef struct {
+    box_pass_fn box_pass;
+    int radii[BOX_PASSES];
+
+    gauss_pass_fn gauss_pass;
+    int radius;
+    const int16_t *weights;
+} filter_t;
+
+/*
+ * Builds the column lookup table of a box pass over rows of the given length:
+ * index[j] is the column at offset j - radius, mirrored at both ends of the
+ * row. Returns NULL if out of memory.
+ */
+static int *create_box_index(int length, int radius) {
+    const int size = length + 2 * radius + 1;
+    int *index = malloc(size * sizeof(int));
+    if (!index)
+        return NULL;
+
+    const int period = length > 1 ? 2 * (length - 1) : 1;
+    for (int j = 0; j < size; j++) {
+        int x = (j - radius) % period;
+        if (x < 0)
+            x += period;
+        index[j] = x < length ? x : period - x;
+    }
+    return index;
+}
+
+typedef struct {
+    const filter_t *filter;
+    const uint32_t *src;
+    int src_stride;
+    uint32_t *dst;
+    int dst_stride;
+    int width, height;
+    int radius;
+    const int *index;
+    int rows_per_chunk;
+} pass_job_t;
+
+static void run_pass_chunk(void *arg, int index) {
+    pass_job_t *job = arg;
+    int row_start = index * job->rows_per_chunk;
+    int row_end = row_start + job->rows_per_chunk;
+    if (row_end > job->height)
+        row_end = job->height;
+    const filter_t *filter = job->filter;
+    if (filter->gauss_pass)
+        filter->gauss_pass(job->src, job->src_stride, job->dst, job->dst_stride,
+                           job->width, job->height, job->radius, job->index, filter->weights, row_start, row_end);
+    else
+        filter->box_pass(job->src, job->src_stride, job->dst, job->dst_stride,
+                         job->width, job->height, job->radius, job->index, row_start, row_end);
+}
+
+/*
+ * Runs one horizontal pass of the filter with its rows split over the worker
+ * pool. Returns once every row is done, so the following (transposed) pass
+ * sees the whole result.
+ */
+static void pass_parallel(const filter_t *filter, const uint32_t *src, int src_stride, uint32_t *dst, int dst_stride,
+                          int width, int height, int radius, const int *index, int threads) {
+    // a few chunks per thread to even out the load; the kernels work on
+    // blocks of BOX_ROWS rows, the AVX2 box pass on pairs of them
+    int rows_per_chunk = (height + threads * 4 - 1) / (threads * 4);
+    rows_per_chunk = (rows_per_chunk + 2 * BOX_ROWS - 1) / (2 * BOX_ROWS) * (2 * BOX_ROWS);
+    pass_job_t job = {filter, src, src_stride, dst, dst_stride, width, height, radius, index, rows_per_chunk};
+    parallel_for((height + rows_per_chunk - 1) / rows_per_chunk, threads, run_pass_chunk, &job);
+}
+
+/*
+ * Computes the radii of BOX_PASSES box filters which together approximate a
+ * Gaussian of standard deviation sigma, following Peter Kovesi [1]: the
+ * passes use the odd widths wl and wl + 2 around the ideal width, m of them
+ * the smaller one.
+ *
+ * [1]: http://www.peterkovesi.com/papers/FastGaussianSmoothing.pdf
+ */
+static void box_radii_for_sigma(double sigma, int radii[BOX_PASSES]) {
+    const int n = BOX_PASSES;
+    double w_ideal = sqrt(12 * sigma * sigma / n + 1);
+    int wl = floor(w_ideal);
+    if (wl % 2 == 0)
+        wl--;
+    const int wu = wl + 2;
+
+    double m_ideal = (12 * sigma * sigma - n * wl * wl - 4 * n * wl - 3 * n) / (-4 * wl - 4);
+    int m = lround(m_ideal);
+
+    for (int i = 0; i < n; i++)
+        radii[i] = ((i < m ? wl : wu) - 1) / 2;
+}
+
+/*
+ * Allocates a 64 byte aligned buffer for rows of stride pixels, stride being a
+ * multiple of BOX_ROWS.
+ */
+static uint32_t *alloc_rows(int stride, int rows) {
+    return aligned_alloc(64, (size_t)stride * rows * sizeof(uint32_t));
+}
+
+/* Rounds a row length up so that the box passes can stream into it. */
+static int padded_stride(int width) {
+    return (width + BOX_ROWS - 1) / BOX_ROWS * BOX_ROWS;
+}
+
+/*
+ * Runs all passes of the filter over the width x count pixels at rows, in
+ * place. tmp receives the transposed intermediate image and must hold width
+ * rows of tmp_stride pixels. Rows beyond the ends are mirrored.
+ */
+static void blur_rows(const filter_t *filter, uint32_t *rows, int stride, int width, int count,
+                      uint32_t *tmp, int tmp_stride, int threads)
+{
+    const int passes = filter->gauss_pass ? 1 : BOX_PASSES;
+    for (int i = 0; i < passes; i++)
+    {
+        const int radius = filter->gauss_pass ? filter->radius : filter->radii[i];
+        if (radius <= 0)
+            continue;
+
+        int *row_index = create_box_index(width, radius);
+        int *column_index = create_box_index(count, radius);
+        if (row_index && column_index) {
+            // horizontal pass includes image transposition:
+            // instead of writing pixel src[x] to dst[x],
+            // we write it to transposed location.
+            // (to be exact: dst[dst_stride * current_column + current_row])
+            pass_parallel(filter, rows, stride, tmp, tmp_stride, width, count, radius, row_index, threads);
+            pass_parallel(filter, tmp, tmp_stride, rows, stride, count, width, radius, column_index, threads);
+        }
+        free(row_index);
+        free(column_index);
+    }
+}
+
+/*
+ * Applies the filter to the width x height pixels at src (rows of stride
+ * pixels) in place.
+ */
+static void separable_blur(const filter_t *filter, uint32_t *src, int stride, int width, int height)
+{
+    const int threads = blur_threads > 0 ? blur_threads : parallel_cpu_count();
+
+    // An output row depends on the input rows up to halo rows away. Bands
+    // carry that many extra rows on each side, which makes the mirrored
+    // edges of every pass wrong only within the halo, never inside the band.
+    int halo = 0;
+    if (filter->gauss_pass)
+        halo = filter->radius;
+    else
+        for (int i = 0; i < BOX_PASSES; i++)
+            halo += filter->radii[i];
+
+    // band buffer and its transposed copy share BAND_BUFFER_BYTES
+    int band = BAND_BUFFER_BYTES / (2 * sizeof(uint32_t) * padded_stride(width)) - 2 * halo;
+    if (band < halo)
+        band = halo;
+    band = padded_stride(band);
+
+    if (height <= band) {
+        // the image fits in a single band: blur it where it is
+        const int tmp_stride = padded_stride(height);
+        uint32_t *tmp = alloc_rows(tmp_stride, width);
+        if (tmp)
+            blur_rows(filter, src, stride, width, height, tmp, tmp_stride, threads);
+        free(tmp);
+        return;
+    }
+
+    const int band_stride = padded_stride(width);
+    const int tmp_stride = padded_stride(band + 2 * halo);
+    uint32_t *rows = alloc_rows(band_stride, band + 2 * halo);
+    uint32_t *tmp = alloc_rows(tmp_stride, width);
+    // the original rows just above the current band, which the previous band
+    // has overwritten by now
+    uint32_t *carry = malloc((size_t)halo * width * sizeof(uint32_t));
+    if (!rows || !tmp || !carry)
+        goto out;
+
+    for (int y0 = 0; y0 < height; y0 += band) {
+        const int y1 = y0 + band < height ? y0 + band : height;
+        const int first = y0 - halo > 0 ? y0 - halo : 0;
+        const int last = y1 + halo < height ? y1 + halo : height;
+
+        for (int y = first; y < last; y++) {
+            const uint32_t *in = y < y0 ? carry + (y - (y0 - halo)) * width : src + y * stride;
+            memcpy(rows + (y - first) * band_stride, in, width * sizeof(uint32_t));
+        }
+
+        blur_rows(filter, rows, band_stride, width, last - first, tmp, tmp_stride, threads);
+
+        if (y1 < height)
+            for (int y = y1 - halo; y < y1; y++)
+                memcpy(carry + (y - (y1 - halo)) * width, src + y * stride, width * sizeof(uint32_t));
+        for (int y = y0; y < y1; y++)
+            memcpy(src + y * stride, rows + (y - first) * band_stride, width * sizeof(uint32_t));
+    }
+
+out:
+    free(rows);
+    free(tmp);
+    free(carry);
+}
+
+/*
+ * Blurs the width x height pixels at src (rows of stride pixels) in place with
+ * the given box pass kernel.
+ */
+static void box_blur(box_pass_fn box_pass, uint32_t *src, int stride, int width, int height, double sigma)
+{
+    // Three box filters approximate a Gaussian well [2]. They are
+    // implemented with running sums, so the cost per pixel does not depend
+    // on sigma.
+    //
+    // [2]: https://en.wikipedia.org/wiki/Gaussian_blur#Mathematics
+    filter_t filter = {.box_pass = box_pass};
+    box_radii_for_sigma(sigma, filter.radii);
+    if (filter.radii[BOX_PASSES - 1] <= 0)
+        return;
+    separable_blur(&filter, src, stride, width, height);
+}
+
+/*
+ * Returns the fixed point weights of a Gaussian of the given sigma over
+ * 2 * radius + 1 taps, plus the zero padding the kernels expect. The rounded
+ * weights sum to exactly 1 << GAUSS_SHIFT, so flat areas keep their colour.
+ * Returns NULL if out of memory.
+ */
+static int16_t *create_gauss_weights(double sigma, int radius) {
+    int16_t *weights = calloc(2 * radius + 2, sizeof(int16_t));
+    if (!weights)
+        return NULL;
+
+    double total = 0;
+    for (int k = -radius; k <= radius; k++)
+        total += exp(-k * k / (2 * sigma * sigma));
+
+    int sum = 0;
+    for (int k = -radius; k <= radius; k++) {
+        weights[k + radius] = lround(exp(-k * k / (2 * sigma * sigma)) / total * (1 << GAUSS_SHIFT));
+        sum += weights[k + radius];
+    }
+    weights[radius] += (1 << GAUSS_SHIFT) - sum;
+    return weights;
+}
+
+/*
+ * Blurs the width x height pixels at src (rows of stride pixels) in place with
+ * a Gaussian, using the given pass kernel. Slower than box_blur() for large
+ * sigmas, as it costs O(sigma) per pixel, but exact.
+ */
+static void gaussian_blur(gauss_pass_fn gauss_pass, uint32_t *src, int stride, int width, int height, double sigma)
+{
+    filter_t filter = {.gauss_pass = gauss_pass, .radius = ceil(GAUSS_CUTOFF * sigma)};
+    if (filter.radius <= 0)
+        return;
+    int16_t *weights = create_gauss_weights(sigma, filter.radius);
+    if (!weights)
+        return;
+    filter.weights = weights;
+    separable_blur(&filter, src, stride, width, height);
+    free(weights);
+}
+
+/* Whether blur_pixels() uses the Gaussian kernel for the given sigma. */
+static bool blur_uses_gaussian(double sigma) {
+    return blur_mode == BLUR_GAUSSIAN || sigma < BOX_MIN_SIGMA;
+}
+
+/* Blurs with the fastest kernel available for blur_mode. */
+static void blur_pixels(uint32_t *src, int stride, int width, int height, double sigma)
+{
+    if (blur_uses_gaussian(sigma)) {
+        static gauss_pass_fn gauss_pass;
+        if (!gauss_pass)
+            gauss_pass = select_gauss_pass();
+        gaussian_blur(gauss_pass, src, stride, width, height, sigma);
+        return;
+    }
+
+    static box_pass_fn box_pass;
+    if (!box_pass)
+        box_pass = select_box_pass();
+    box_blur(box_pass, src, stride, width, height, sigma);
+}
+
+/*
+ * Returns by how many powers of two the image can be shrunk before blurring
+ * with the given sigma while keeping at least blur_quality pixels of sigma.
+ */
+static int downscale_steps(int sigma) {
+    if (blur_quality <= 0)
+        return 0;
+    int steps = 0;
+    while (steps < MAX_DOWNSCALE_STEPS && (sigma >> (steps + 1)) >= blur_quality)
+        steps++;
+    return steps;
+}
+
+typedef struct {
+    uint32_t *large;
+    int width, height;
+    uint32_t *small;
+    int small_width, small_height, small_stride;
+    int factor;
+
+    /* bilinear upsampling: source columns and weights (0..256) per column */
+    int *x0, *x1, *wx;
+} scale_job_t;
+
+/* Averages factor x factor blocks of the large image into row y of the small one. */
+static void downsample_row(void *arg, int y) {
+    scale_job_t *job = arg;
+    const int y_start = y * job->factor;
+    const int y_end = y_start + job->factor < job->height ? y_start + job->factor : job->height;
+
+    for (int x = 0; x < job->small_width; x++) {
+        const int x_start = x * job->factor;
+        const int x_end = x_start + job->factor < job->width ? x_start + job->factor : job->width;
+        // two channels per word, 16 bits each: enough for 16x16 blocks
+        uint32_t even = 0, odd = 0;
+        for (int yy = y_start; yy < y_end; yy++) {
+            const uint32_t *in = job->large + yy * job->width;
+            for (int xx = x_start; xx < x_end; xx++) {
+                even += in[xx] & 0x00FF00FF;
+                odd += (in[xx] >> 8) & 0x00FF00FF;
+            }
+        }
+        const uint32_t count = (y_end - y_start) * (x_end - x_start);
+        const uint32_t half = count / 2;
+        job->small[y * job->small_stride + x] =
+            (((even & 0xFFFF) + half) / count) |
+            ((((even >> 16) + half) / count) << 16) |
+            ((((odd & 0xFFFF) + half) / count) << 8) |
+            ((((odd >> 16) + half) / count) << 24);
+    }
+}
+
+/* Blends two pixels, weight is the share of b out of 256. */
+static inline uint32_t lerp_pixel(uint32_t a, uint32_t b, int weight) {
+    const uint32_t even = ((a & 0x00FF00FF) * (256 - weight) + (b & 0x00FF00FF) * weight) >> 8;
+    const uint32_t odd = (((a >> 8) & 0x00FF00FF) * (256 - weight) + ((b >> 8) & 0x00FF00FF) * weight) >> 8;
+    return (even & 0x00FF00FF) | ((odd & 0x00FF00FF) << 8);
+}
+
+/* Maps output coordinate i to the two nearest small image samples. */
+static void bilinear_source(int i, int factor, int small_size, int *i0, int *i1, int *weight) {
+    const double pos = (i + 0.5) / factor - 0.5;
+    int base = floor(pos);
+    *weight = lround((pos - base) * 256);
+    *i0 = base < 0 ? 0 : (base >= small_size ? small_size - 1 : base);
+    *i1 = base + 1 < 0 ? 0 : (base + 1 >= small_size ? small_size - 1 : base + 1);
+}
+
+/* Interpolates row y of the large image from the small one. */
+static void upsample_row(void *arg, int y) {
+    scale_job_t *job = arg;
+    int y0, y1, wy;
+    bilinear_source(y, job->factor, job->small_height, &y0, &y1, &wy);
+    const uint32_t *row0 = job->small + y0 * job->small_stride;
+    const uint32_t *row1 = job->small + y1 * job->small_stride;
+    uint32_t *out = job->large + y * job->width;
+
+    for (int x = 0; x < job->width; x++) {
+        const uint32_t top = lerp_pixel(row0[job->x0[x]], row0[job->x1[x]], job->wx[x]);
+        const uint32_t bottom = lerp_pixel(row1[job->x0[x]], row1[job->x1[x]], job->wx[x]);
+        out[x] = lerp_pixel(top, bottom, wy);
+    }
+}
+
+/*
+ * Large sigmas leave no high frequencies, so blur a box-filtered copy that is
+ * smaller by 2^steps in each direction and scale it back up bilinearly.
+ * Returns false if there was not enough memory.
+ */
+static bool blur_pixels_downscaled(uint32_t *src, int width, int height, int sigma, int steps)
+{
+    scale_job_t job;
+    job.large = src;
+    job.width = width;
+    job.height = height;
+    job.factor = 1 << steps;
+    job.small_width = (width + job.factor - 1) / job.factor;
+    job.small_height = (height + job.factor - 1) / job.factor;
+    job.small_stride = padded_stride(job.small_width);
+    job.small = alloc_rows(job.small_stride, job.small_height);
+    job.x0 = malloc(3 * width * sizeof(int));
+    if (!job.small || !job.x0) {
+        free(job.small);
+        free(job.x0);
+        return false;
+    }
+    job.x1 = job.x0 + width;
+    job.wx = job.x1 + width;
+    for (int x = 0; x < width; x++)
+        bilinear_source(x, job.factor, job.small_width, &job.x0[x], &job.x1[x], &job.wx[x]);
+
+    const int threads = blur_threads > 0 ? blur_threads : parallel_cpu_count();
+    parallel_for(job.small_height, threads, downsample_row, &job);
+    blur_pixels(job.small, job.small_stride, job.small_width, job.small_height, (double)sigma / job.factor);
+    parallel_for(height, threads, upsample_row, &job);
+
+    free(job.small);
+    free(job.x0);
+    return true;
+}
+
+/*
+ * Spreads the four channels of a pixel to 16 bits each, so that weighted sums
+ * of up to 256 pixels can be added up with plain 64 bit arithmetic.
+ */
+static inline uint64_t widen_pixel(uint32_t p) {
+    return (p & 0x00FF00FF) | (uint64_t)(p & 0xFF00FF00) << 24;
+}
+
+/* Divides the four sums by 2^shift, rounding to the nearest integer, and packs them again. */
+static inline uint32_t narrow_pixel(uint64_t sum, int shift) {
+    sum = ((sum + 0x0001000100010001ULL * (1 << (shift - 1))) >> shift) & 0x00FF00FF00FF00FFULL;
+    return (uint32_t)(sum & 0x00FF00FF) | (uint32_t)(sum >> 24);
+}
+
+typedef struct {
+    const uint32_t *large;
+    int large_width, large_height;
+    uint32_t *small;
+    int small_width, small_height;
+    kawase_down_fn down;
+    kawase_up_fn up;
+} kawase_job_t;
+
+static inline uint64_t kawase_tap(const kawase_job_t *job, int x, int y) {
+    x = x < 0 ? 0 : (x >= job->large_width ? job->large_width - 1 : x);
+    y = y < 0 ? 0 : (y >= job->large_height ? job->large_height - 1 : y);
+    return widen_pixel(job->large[y * job->large_width + x]);
+}
+
+/*
+ * Computes row y of the half resolution image: the 2x2 block under the pixel
+ * plus the four pixels diagonally outside of it, all weighted equally. The
+ * kernel does the columns whose taps are all inside the image, the edges are
+ * clamped here.
+ */
+static void kawase_down_row(void *arg, int y) {
+    kawase_job_t *job = arg;
+    const int sy = 2 * y;
+    uint32_t *out = job->small + y * job->small_width;
+    // columns 1 <= x < end read 2x - 1 to 2x + 2; rows 1 <= y, 2y + 2 < height
+    // need no clamping either
+    const int end = (job->large_width - 1) / 2;
+    const bool inside = sy >= 1 && sy + 2 < job->large_height && end > 1;
+    if (inside) {
+        const uint32_t *top = job->large + sy * job->large_width;
+        job->down(top - job->large_width, top, top + job->large_width, top + 2 * job->large_width, out, 1, end);
+    }
+
+    for (int x = 0; x < job->small_width; x++) {
+        if (inside && x == 1)
+            x = end;
+        if (x >= job->small_width)
+            break;
+        const int sx = 2 * x;
+        uint64_t sum = kawase_tap(job, sx, sy) + kawase_tap(job, sx + 1, sy) +
+                       kawase_tap(job, sx, sy + 1) + kawase_tap(job, sx + 1, sy + 1) +
+                       kawase_tap(job, sx - 1, sy - 1) + kawase_tap(job, sx + 2, sy - 1) +
+                       kawase_tap(job, sx - 1, sy + 2) + kawase_tap(job, sx + 2, sy + 2);
+        out[x] = narrow_pixel(sum, 3);
+    }
+}
+
+/*
+ * Computes row y of the double resolution image (job->large, written to
+ * here) by interpolating the four nearest pixels of the small one with
+ * weights 9, 3, 3 and 1. The kernel does the pixel pairs whose neighbours
+ * are all inside the row.
+ */
+static void kawase_up_row(void *arg, int y) {
+    kawase_job_t *job = arg;
+    uint32_t *out = (uint32_t *)job->large + y * job->large_width;
+    const int y0 = y / 2;
+    int y1 = y % 2 ? y0 + 1 : y0 - 1;
+    y1 = y1 < 0 ? 0 : (y1 >= job->small_height ? job->small_height - 1 : y1);
+    const uint32_t *row0 = job->small + y0 * job->small_width;
+    const uint32_t *row1 = job->small + y1 * job->small_width;
+
+    // pairs 1 <= k < end read columns k - 1 to k + 1 and write 2k + 1 < width
+    int end = job->large_width / 2;
+    if (end > job->small_width - 1)
+        end = job->small_width - 1;
+    const bool inside = end > 1;
+    if (inside)
+        job->up(row0, row1, out, 1, end);
+
+    for (int x = 0; x < job->large_width; x++) {
+        if (inside && x == 2)
+            x = 2 * end;
+        if (x >= job->large_width)
+            break;
+        const int x0 = x / 2;
+        int x1 = x % 2 ? x0 + 1 : x0 - 1;
+        x1 = x1 < 0 ? 0 : (x1 >= job->small_width ? job->small_width - 1 : x1);
+        uint64_t sum = 9 * widen_pixel(row0[x0]) + 3 * widen_pixel(row0[x1]) +
+                       3 * widen_pixel(row1[x0]) + widen_pixel(row1[x1]);
+        out[x] = narrow_pixel(sum, 4);
+    }
+}
+
+/*
+ * Returns the variance (in full resolution pixels squared) of the blur that
+ * the given number of dual filter levels amount to. Shrinking spreads a
+ * pixel by 1.25 and enlarging by 0.75 pixels squared of the level it reads,
+ * and every level has 4 times the pixel area of the previous one, which sums
+ * up to 2 * (4^levels - 1) / 3.
+ */
+static double kawase_variance(int levels) {
+    return 2.0 * ((1 << 2 * levels) - 1) / 3;
+}
+
+/*
+ * Returns how many times the dual filter halves the image for the given
+ * sigma, see KAWASE_SHARE.
+ */
+static int kawase_levels(int sigma) {
+    int levels = 0;
+    while (levels < MAX_KAWASE_LEVELS && kawase_variance(levels + 1) <= KAWASE_SHARE * sigma * sigma)
+        levels++;
+    return levels;
+}
+
+/*
+ * Returns the sigma (in pixels of the smallest level) of the Gaussian which
+ * makes up for the blur the levels fall short of.
+ */
+static double kawase_residual(int sigma, int levels) {
+    const double variance = (double)sigma * sigma - kawase_variance(levels);
+    return variance > 0 ? sqrt(variance) / (1 << levels) : 0;
+}
+
+/*
+ * Dual filter blur (after Marius Bjørge's "Bandwidth-efficient rendering"):
+ * shrinks the image level by level with a small filter, then scales it back
+ * up the same way. All the work happens at half resolution or below, so a
+ * strong blur costs little more than two passes over the image. The levels
+ * only blur in steps of powers of two, so the smallest level gets a small
+ * Gaussian to reach the given sigma. down and up compute the inside of every
+ * row, see blur_impl_kawase_down_generic().
+ * Returns false if there was not enough memory.
+ */
+static bool dual_kawase_blur(kawase_down_fn down, kawase_up_fn up, uint32_t *src, int width, int height, int sigma)
+{
+    uint32_t *levels[MAX_KAWASE_LEVELS + 1] = {src};
+    int widths[MAX_KAWASE_LEVELS + 1] = {width}, heights[MAX_KAWASE_LEVELS + 1] = {height};
+    int count = kawase_levels(sigma);
+    // stop at a few pixels, there is nothing left to blur
+    while (count > 0 && ((width >> count) < 2 || (height >> count) < 2))
+        count--;
+
+    bool ok = true;
+    for (int i = 1; i <= count; i++) {
+        widths[i] = (widths[i - 1] + 1) / 2;
+        heights[i] = (heights[i - 1] + 1) / 2;
+        levels[i] = malloc((size_t)widths[i] * heights[i] * sizeof(uint32_t));
+        ok = ok && levels[i];
+    }
+
+    if (ok) {
+        const int threads = blur_threads > 0 ? blur_threads : parallel_cpu_count();
+        for (int i = 0; i < count; i++) {
+            kawase_job_t job = {levels[i], widths[i], heights[i], levels[i + 1], widths[i + 1], heights[i + 1], down, up};
+            parallel_for(heights[i + 1], threads, kawase_down_row, &job);
+        }
+        static gauss_pass_fn gauss_pass;
+        if (!gauss_pass)
+            gauss_pass = select_gauss_pass();
+        gaussian_blur(gauss_pass, levels[count], widths[count], widths[count], heights[count],
+                      kawase_residual(sigma, count));
+        for (int i = count; i > 0; i--) {
+            kawase_job_t job = {levels[i - 1], widths[i - 1], heights[i - 1], levels[i], widths[i], heights[i], down, up};
+            parallel_for(heights[i - 1], threads, kawase_up_row, &job);
+        }
+    }
+
+    for (int i = 1; i <= count; i++)
+        free(levels[i]);
+    return ok;
+}
+
+/*
+ * Blurs the width x height pixels at src (rows without padding) with the
+ * filter selected by blur_mode. The dual filter and downscaling only work on
+ * colour pixels.
+ */
+static void blur_buffer(uint32_t *src, int width, int height, int sigma, bool color)
+{
+    bool done = false;
+    const int steps = color ? downscale_steps(sigma) : 0;
+
+    if (color && blur_mode == BLUR_DUAL_KAWASE) {
+        static kawase_down_fn down;
+        static kawase_up_fn up;
+        if (!down)
+            select_kawase(&down, &up);
+        done = dual_kawase_blur(down, up, src, width, height, sigma);
+    }
+    else if (steps > 0)
+        done = blur_pixels_downscaled(src, width, height, sigma, steps);
+    if (!done)
+        blur_pixels(src, width, width, height, sigma);
+}
+
+/*
+ * Returns how far (in pixels) blur_buffer() spreads a pixel for the given
+ * sigma, and in align the grid its down- and upsampling work on.
+ */
+static int blur_reach(int sigma, int *align)
+{
+    if (blur_mode == BLUR_DUAL_KAWASE) {
+        // every level reads 2 pixels out when shrinking, 1 when enlarging,
+        // plus the Gaussian on the smallest level
+        const int levels = kawase_levels(sigma);
+        *align = 1 << levels;
+        return (3 + (int)ceil(GAUSS_CUTOFF * kawase_residual(sigma, levels))) << levels;
+    }
+
+    const int factor = 1 << downscale_steps(sigma);
+    int reach = 0;
+    if (blur_uses_gaussian((double)sigma / factor)) {
+        reach = ceil(GAUSS_CUTOFF * (double)sigma / factor);
+    } else {
+        int radii[BOX_PASSES];
+        box_radii_for_sigma((double)sigma / factor, radii);
+        for (int i = 0; i < BOX_PASSES; i++)
+            reach += radii[i];
+    }
+    *align = factor;
+    // sampling down and back up reaches one more shrunk pixel each way
+    return (reach + 2) * factor;
+}
+
 /* Performs a simple 2D Gaussian blur of standard devation @sigma surface @surface. */
 void
 blur_image_surface (cairo_surface_t *surface, int sigma)
 {
-    cairo_surface_t *tmp;
     int width, height;
-    uint32_t *src, *dst;
+    uint32_t *src;
+    bool color = false;
 
     if (cairo_surface_status (surface))
     return;
@@ -52,98 +793,533 @@ blur_image_surface (cairo_surface_t *surface, int sigma)
 
     case CAIRO_FORMAT_RGB24:
     case CAIRO_FORMAT_ARGB32:
+    color = true;
     break;
     }
 
-    tmp = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, width, height);
-    if (cairo_surface_status (tmp))
+    if (width <= 0 || height <= 0)
     return;
 
+    cairo_surface_flush (surface);
     src = (uint32_t*)cairo_image_surface_get_data (surface);
-    dst = (uint32_t*)cairo_image_surface_get_data (tmp);
-
-    // according to a paper by Peter Kovesi [1], box filter of width w, equals to Gaussian blur of following sigma:
-    // σ_av = sqrt((w*w-1)/12)
-    // for our 7x7 filter we have σ_av = 2.0.
-    // applying the same Gaussian filter n times results in σ_n = sqrt(n*σ_av*σ_av) [2]
-    // after some trivial math, we arrive at n = ((σ_d)/(σ_av))^2
-    // since it's a box blur filter, n >= 3
-    //
-    // [1]: http://www.peterkovesi.com/papers/FastGaussianSmoothing.pdf
-    // [2]: https://en.wikipedia.org/wiki/Gaussian_blur#Mathematics
 
-    int n = lrintf((sigma*sigma)/(SIGMA_AV*SIGMA_AV));
-    if (n < 3) n = 3;
+    blur_buffer(src, width, height, sigma, color);
 
-    for (int i = 0; i < n; i++)
-    {
-        // horizontal pass includes image transposition:
-        // instead of writing pixel src[x] to dst[x],
-        // we write it to transposed location.
-        // (to be exact: dst[height * current_column + current_row])
+    cairo_surface_mark_dirty (surface);
+}
+
+/*
+ * Blurs the part of @surface inside @rect as if the whole surface had been
+ * blurred: the rectangle plus the pixels the blur reaches into it are copied
+ * out, blurred and only the rectangle is written back.
+ */
+void blur_image_region(cairo_surface_t *surface, const cairo_rectangle_int_t *rect, int sigma)
+{
+    if (cairo_surface_status(surface))
+        return;
+    const cairo_format_t format = cairo_image_surface_get_format(surface);
+    if (format != CAIRO_FORMAT_ARGB32 && format != CAIRO_FORMAT_RGB24)
+        return;
+
+    const int width = cairo_image_surface_get_width(surface);
+    const int height = cairo_image_surface_get_height(surface);
+    const int stride = cairo_image_surface_get_stride(surface) / sizeof(uint32_t);
+    const int x0 = rect->x > 0 ? rect->x : 0;
+    const int y0 = rect->y > 0 ? rect->y : 0;
+    const int x1 = rect->x + rect->width < width ? rect->x + rect->width : width;
+    const int y1 = rect->y + rect->height < height ? rect->y + rect->height : height;
+    if (x0 >= x1 || y0 >= y1)
+        return;
+
+    // keep the sampling grid of a full surface blur, so the result matches
+    int align;
+    const int reach = blur_reach(sigma, &align);
+    const int ex0 = (x0 - reach > 0 ? x0 - reach : 0) / align * align;
+    const int ey0 = (y0 - reach > 0 ? y0 - reach : 0) / align * align;
+    const int ex1 = x1 + reach < width ? x1 + reach : width;
+    const int ey1 = y1 + reach < height ? y1 + reach : height;
+    const int region_width = ex1 - ex0, region_height = ey1 - ey0;
+
+    uint32_t *region = malloc((size_t)region_width * region_height * sizeof(uint32_t));
+    if (!region)
+        return;
+
+    cairo_surface_flush(surface);
+    uint32_t *pixels = (uint32_t *)cairo_image_surface_get_data(surface);
+    for (int y = ey0; y < ey1; y++)
+        memcpy(region + (y - ey0) * region_width, pixels + y * stride + ex0, region_width * sizeof(uint32_t));
+
+    blur_buffer(region, region_width, region_height, sigma, true);
+
+    for (int y = y0; y < y1; y++)
+        memcpy(pixels + y * stride + x0, region + (y - ey0) * region_width + (x0 - ex0), (x1 - x0) * sizeof(uint32_t));
+    free(region);
+
+    cairo_surface_mark_dirty_rectangle(surface, x0, y0, x1 - x0, y1 - y0);
+}
+
+/* Adds the channels of count pixels to sums (one total per byte of a pixel). */
+static void sum_pixels(const uint32_t *px, int count, uint32_t sums[4]) {
+    int i = 0;
 #ifdef __SSE2__
-        blur_impl_horizontal_pass_sse2(src, dst, width, height);
-        blur_impl_horizontal_pass_sse2(dst, src, height, width);
-#else
-        blur_impl_horizontal_pass_generic(src, dst, width, height);
-        blur_impl_horizontal_pass_generic(dst, src, height, width);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    for (; i + 4 <= count; i += 4) {
+        const __m128i v = _mm_loadu_si128((const __m128i *)(px + i));
+        // four pixels to two: 16 bit channel sums of pixels 0+2 and 1+3
+        const __m128i pairs = _mm_add_epi16(_mm_unpacklo_epi8(v, zero), _mm_unpackhi_epi8(v, zero));
+        acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_unpacklo_epi16(pairs, zero), _mm_unpackhi_epi16(pairs, zero)));
+    }
+    uint32_t lanes[4];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    for (int c = 0; c < 4; c++)
+        sums[c] += lanes[c];
+#endif
+    for (; i < count; i++)
+        for (int c = 0; c < 4; c++)
+            sums[c] += (px[i] >> (8 * c)) & 0xFF;
+}
+
+typedef struct {
+    uint32_t *pixels;
+    int width, height, stride;
+    int block;
+} pixelate_job_t;
+
+/* Replaces every block in the given row of blocks with its average colour. */
+static void pixelate_row(void *arg, int row) {
+    pixelate_job_t *job = arg;
+    const int y0 = row * job->block;
+    const int y1 = y0 + job->block < job->height ? y0 + job->block : job->height;
+
+    for (int x0 = 0; x0 < job->width; x0 += job->block) {
+        const int w = x0 + job->block < job->width ? job->block : job->width - x0;
+        uint32_t sums[4] = {0, 0, 0, 0};
+        for (int y = y0; y < y1; y++)
+            sum_pixels(job->pixels + y * job->stride + x0, w, sums);
+
+        const uint32_t count = w * (y1 - y0);
+        uint32_t color = 0;
+        for (int c = 0; c < 4; c++)
+            color |= ((sums[c] + count / 2) / count) << (8 * c);
+        for (int y = y0; y < y1; y++) {
+            uint32_t *out = job->pixels + y * job->stride + x0;
+            for (int x = 0; x < w; x++)
+                out[x] = color;
+        }
+    }
+}
+
+/* Replaces every @block x @block square of @surface with its average colour. */
+void pixelate_image_surface(cairo_surface_t *surface, int block)
+{
+    if (block <= 1 || cairo_surface_status(surface))
+        return;
+
+    const cairo_format_t format = cairo_image_surface_get_format(surface);
+    if (format != CAIRO_FORMAT_ARGB32 && format != CAIRO_FORMAT_RGB24)
+        return;
+
+    pixelate_job_t job;
+    job.width = cairo_image_surface_get_width(surface);
+    job.height = cairo_image_surface_get_height(surface);
+    job.stride = cairo_image_surface_get_stride(surface) / sizeof(uint32_t);
+    job.block = block;
+    if (job.width <= 0 || job.height <= 0)
+        return;
+
+    cairo_surface_flush(surface);
+    job.pixels = (uint32_t *)cairo_image_surface_get_data(surface);
+    const int threads = blur_threads > 0 ? blur_threads : parallel_cpu_count();
+    parallel_for((job.height + block - 1) / block, threads, pixelate_row, &job);
+    cairo_surface_mark_dirty(surface);
+}
+
+typedef struct {
+    const char *name;
+    box_pass_fn box_pass;
+    gauss_pass_fn gauss_pass;
+    kawase_down_fn kawase_down;
+    kawase_up_fn kawase_up;
+} bench_kernel_t;
+
+/* Fills kernels with every kernel set this CPU can run, returns the count.
+ * Sets without a box pass or dual filter kernels have those set to NULL. */
+static int available_kernels(bench_kernel_t kernels[3]) {
+    int count = 0;
+    kernels[count++] = (bench_kernel_t){"generic", blur_impl_box_pass_generic, blur_impl_gauss_pass_generic,
+                                      blur_impl_kawase_down_generic, blur_impl_kawase_up_generic};
+#ifdef __SSE2__
+    kernels[count++] = (bench_kernel_t){"sse2", blur_impl_box_pass_sse2, blur_impl_gauss_pass_sse2,
+                                          blur_impl_kawase_down_sse2, blur_impl_kawase_up_sse2};
+#endif
+#ifdef BLUR_X86_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        kernels[count++] = (bench_kernel_t){"avx2", blur_impl_box_pass_avx2, blur_impl_gauss_pass_avx2, NULL, NULL};
 #endif
+    return count;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Sharp edges plus noise, so that blurring actually has work to do. */
+static void fill_test_image(uint32_t *pixels, int stride, int width, int height) {
+    srand(1);
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+            pixels[y * stride + x] = rand() % 4 == 0 ? (uint32_t)rand() * 2654435761u
+                                                      : ((x / 32 + y / 32) % 2 ? 0xFFFFFFFF : 0xFF000000);
+}
+
+/*
+ * Runs every SIMD kernel on random images, sizes, radii and strides (both the
+ * streaming and the unaligned store paths) and compares the result with the
+ * generic kernel. Returns the number of mismatching cases.
+ */
+static int check_kernels(const bench_kernel_t *kernels, int count) {
+    int failures = 0;
+    srand(2);
+    for (int i = 0; i < 200; i++) {
+        const int width = 1 + rand() % 300, height = 1 + rand() % 80, radius = rand() % 50;
+        // odd cases test the Gaussian kernels, even ones the box kernels
+        const bool gauss = i % 4 >= 2;
+        const int src_stride = width + rand() % 5;
+        const int dst_stride = i % 2 ? padded_stride(height) : height + rand() % 3;
+        int *index = create_box_index(width, radius);
+        int16_t *weights = create_gauss_weights(radius / (double)GAUSS_CUTOFF + 0.5, radius);
+        uint32_t *src = malloc((size_t)src_stride * height * sizeof(uint32_t));
+        uint32_t *expected = alloc_rows(padded_stride(dst_stride), width);
+        uint32_t *actual = alloc_rows(padded_stride(dst_stride), width);
+        if (!index || !weights || !src || !expected || !actual) {
+            free(index);
+            free(weights);
+            free(src);
+            free(expected);
+            free(actual);
+            return failures + 1;
+        }
+        for (int j = 0; j < src_stride * height; j++)
+            src[j] = (uint32_t)rand() * 2654435761u;
+
+        const size_t size = (size_t)dst_stride * width * sizeof(uint32_t);
+        for (int k = 0; k < count; k++) {
+            if (!gauss && !kernels[k].box_pass)
+                continue;
+            uint32_t *dst = k == 0 ? expected : actual;
+            memset(dst, 0, size);
+            if (gauss)
+                kernels[k].gauss_pass(src, src_stride, dst, dst_stride, width, height, radius, index, weights, 0, height);
+            else
+                kernels[k].box_pass(src, src_stride, dst, dst_stride, width, height, radius, index, 0, height);
+            if (k > 0 && memcmp(expected, actual, size) != 0) {
+                printf("  %s %s pass differs from generic: %dx%d, radius %d, strides %d/%d\n",
+                       kernels[k].name, gauss ? "Gaussian" : "box", width, height, radius, src_stride, dst_stride);
+                failures++;
+            }
+        }
+        free(index);
+        free(weights);
+        free(src);
+        free(expected);
+        free(actual);
     }
 
-    cairo_surface_destroy (tmp);
-    cairo_surface_flush (surface);
-    cairo_surface_mark_dirty (surface);
+    // the dual filter kernels only do the inside of the image, so compare
+    // whole blurs, odd sizes included
+    for (int i = 0; i < 50; i++) {
+        const int width = 1 + rand() % 300, height = 1 + rand() % 80, sigma = 1 + rand() % 30;
+        const size_t size = (size_t)width * height * sizeof(uint32_t);
+        uint32_t *src = malloc(size);
+        uint32_t *expected = malloc(size);
+        uint32_t *actual = malloc(size);
+        if (!src || !expected || !actual) {
+            free(src);
+            free(expected);
+            free(actual);
+            return failures + 1;
+        }
+        for (int j = 0; j < width * height; j++)
+            src[j] = (uint32_t)rand() * 2654435761u;
+
+        memcpy(expected, src, size);
+        dual_kawase_blur(kernels[0].kawase_down, kernels[0].kawase_up, expected, width, height, sigma);
+        for (int k = 1; k < count; k++) {
+            if (!kernels[k].kawase_down)
+                continue;
+            memcpy(actual, src, size);
+            dual_kawase_blur(kernels[k].kawase_down, kernels[k].kawase_up, actual, width, height, sigma);
+            if (memcmp(expected, actual, size) != 0) {
+                printf("  %s dual filter differs from generic: %dx%d, sigma %d\n", kernels[k].name, width, height, sigma);
+                failures++;
+            }
+        }
+        free(src);
+        free(expected);
+        free(actual);
+    }
+    return failures;
+}
+
+/*
+ * Blurs the pixels with an exact Gaussian in double precision, mirrored at
+ * the edges like the box passes.
+ */
+static void reference_gaussian(const uint32_t *src, double *out, int width, int height, double sigma) {
+    const int radius = ceil(4 * sigma);
+    double *weights = malloc((2 * radius + 1) * sizeof(double));
+    double *tmp = malloc((size_t)width * height * 4 * sizeof(double));
+    int *row_index = create_box_index(width, radius);
+    int *column_index = create_box_index(height, radius);
+    if (!weights || !tmp || !row_index || !column_index)
+        goto out;
+
+    double total = 0;
+    for (int k = -radius; k <= radius; k++)
+        total += weights[k + radius] = exp(-k * k / (2 * sigma * sigma));
+    for (int k = 0; k <= 2 * radius; k++)
+        weights[k] /= total;
+
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+            for (int c = 0; c < 4; c++) {
+                double sum = 0;
+                for (int k = 0; k <= 2 * radius; k++)
+                    sum += weights[k] * ((src[y * width + row_index[x + k]] >> (8 * c)) & 0xFF);
+                tmp[(y * width + x) * 4 + c] = sum;
+            }
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+            for (int c = 0; c < 4; c++) {
+                double sum = 0;
+                for (int k = 0; k <= 2 * radius; k++)
+                    sum += weights[k] * tmp[(column_index[y + k] * width + x) * 4 + c];
+                out[(y * width + x) * 4 + c] = sum;
+            }
+
+out:
+    free(weights);
+    free(tmp);
+    free(row_index);
+    free(column_index);
+}
+
+static void report_error(const char *label, const uint32_t *pixels, const double *reference, int width, int height) {
+    double max_error = 0, total = 0;
+    for (int i = 0; i < width * height; i++)
+        for (int c = 0; c < 4; c++) {
+            const double error = fabs(((pixels[i] >> (8 * c)) & 0xFF) - reference[i * 4 + c]);
+            if (error > max_error)
+                max_error = error;
+            total += error;
+        }
+    printf("  %-12s max error %5.2f, mean error %.3f\n", label, max_error, total / (width * height * 4.0));
 }
 
-void blur_impl_horizontal_pass_generic(uint32_t *src, uint32_t *dst, int width, int height) {
-		uint32_t *o_src = src;
-    for (int row = 0; row < height; row++) {
-        for (int column = 0; column < width; column++, src++) {
-            uint32_t rgbaIn[KERNEL_SIZE + 1];
-
-            // handle borders
-            int leftBorder = column < HALF_KERNEL;
-            int rightBorder = column > width - HALF_KERNEL;
-            int i = 0;
-            if (leftBorder) {
-                // for kernel size 7x7 and column == 0, we have:
-                // x x x P0 P1 P2 P3
-                // first loop mirrors P{0..3} to fill x's,
-                // second one loads P{0..3}
-                for (; i < HALF_KERNEL - column; i++)
-                    rgbaIn[i] = *(src + (HALF_KERNEL - i));
-                for (; i < KERNEL_SIZE; i++)
-                    rgbaIn[i] = *(src - (HALF_KERNEL - i));
-            } else if (rightBorder) {
-                for (; i < width - column; i++)
-                    rgbaIn[i] = *(src + i);
-                for (int k = 0; i < KERNEL_SIZE; i++, k++)
-                    rgbaIn[i] = *(src - k);
-            } else {
-                for (; i < KERNEL_SIZE; i++) {
-                    if ((uintptr_t) ((src + 4*i - HALF_KERNEL) + 1)
-                            > (uintptr_t) (o_src + (height * width)))
-                        break;
-              			rgbaIn[i] = *(src + i - HALF_KERNEL);
-								}
+void blur_benchmark(void) {
+    bench_kernel_t kernels[3];
+    const int count = available_kernels(kernels);
+    const int threads = blur_threads > 0 ? blur_threads : parallel_cpu_count();
+
+    int box_default = 0, kawase_default = 0;
+    printf("kernels:");
+    for (int k = 0; k < count; k++) {
+        printf(" %s", kernels[k].name);
+        if (kernels[k].box_pass)
+            box_default = k;
+        if (kernels[k].kawase_down)
+            kawase_default = k;
+    }
+    printf(" (default %s, box %s, dual filter %s), %d thread(s)\n\n",
+           kernels[count - 1].name, kernels[box_default].name, kernels[kawase_default].name, threads);
+
+    printf("bit-exactness against generic:\n");
+    const int failures = check_kernels(kernels, count);
+    printf("  %s\n\n", failures ? "FAILED" : "ok");
+
+    printf("accuracy against a double precision Gaussian (640x480, channel values 0-255):\n");
+    {
+        const int width = 640, height = 480;
+        uint32_t *original = malloc((size_t)width * height * sizeof(uint32_t));
+        uint32_t *pixels = malloc((size_t)width * height * sizeof(uint32_t));
+        double *reference = malloc((size_t)width * height * 4 * sizeof(double));
+        if (original && pixels && reference) {
+            fill_test_image(original, width, width, height);
+            const int sigmas[] = {1, 2, 5, 10, 20, 40};
+            for (size_t i = 0; i < sizeof(sigmas) / sizeof(sigmas[0]); i++) {
+                printf(" sigma %d:\n", sigmas[i]);
+                reference_gaussian(original, reference, width, height, sigmas[i]);
+
+                // as --blur-mode=box blurs, including the Gaussian for small sigmas
+                const blur_mode_t mode = blur_mode;
+                blur_mode = BLUR_BOX;
+                memcpy(pixels, original, (size_t)width * height * sizeof(uint32_t));
+                blur_pixels(pixels, width, width, height, sigmas[i]);
+                report_error("box", pixels, reference, width, height);
+                blur_mode = mode;
+
+                memcpy(pixels, original, (size_t)width * height * sizeof(uint32_t));
+                gaussian_blur(select_gauss_pass(), pixels, width, width, height, sigmas[i]);
+                report_error("gaussian", pixels, reference, width, height);
+
+                memcpy(pixels, original, (size_t)width * height * sizeof(uint32_t));
+                if (dual_kawase_blur(kernels[kawase_default].kawase_down, kernels[kawase_default].kawase_up,
+                                     pixels, width, height, sigmas[i]))
+                    report_error("dual-kawase", pixels, reference, width, height);
+
+                const int steps = downscale_steps(sigmas[i]);
+                memcpy(pixels, original, (size_t)width * height * sizeof(uint32_t));
+                if (steps > 0 && blur_pixels_downscaled(pixels, width, height, sigmas[i], steps)) {
+                    char label[16];
+                    snprintf(label, sizeof(label), "downscaled%d", 1 << steps);
+                    report_error(label, pixels, reference, width, height);
+                }
             }
+        }
+        free(original);
+        free(pixels);
+        free(reference);
+    }
 
-            uint32_t acc[4] = {0};
+    printf("\nthroughput of the full resolution blur (best of 3):\n");
+    const int sizes[][2] = {{1280, 720}, {1920, 1080}, {3840, 2160}};
+    const int sigmas[] = {2, 10, 40};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        const int width = sizes[i][0], height = sizes[i][1];
+        uint32_t *pixels = malloc((size_t)width * height * sizeof(uint32_t));
+        if (!pixels)
+            continue;
+        fill_test_image(pixels, width, width, height);
+        for (size_t j = 0; j < sizeof(sigmas) / sizeof(sigmas[0]); j++) {
+            // the Gaussian costs O(sigma) per pixel, only time it for small sigmas
+            for (int mode = BLUR_BOX; mode <= (sigmas[j] <= 10 ? BLUR_DUAL_KAWASE : BLUR_BOX); mode++) {
+                static const char *mode_names[] = {"box", "gaussian", "dual-kawase"};
+                printf("  %4dx%-4d sigma %2d %-11s:", width, height, sigmas[j], mode_names[mode]);
+                for (int k = 0; k < count; k++) {
+                    if ((mode == BLUR_BOX && !kernels[k].box_pass) || (mode == BLUR_DUAL_KAWASE && !kernels[k].kawase_down))
+                        continue;
+                    double best = INFINITY;
+                    for (int run = 0; run < 3; run++) {
+                        const double start = now_seconds();
+                        if (mode == BLUR_BOX)
+                            box_blur(kernels[k].box_pass, pixels, width, width, height, sigmas[j]);
+                        else if (mode == BLUR_GAUSSIAN)
+                            gaussian_blur(kernels[k].gauss_pass, pixels, width, width, height, sigmas[j]);
+                        else
+                            dual_kawase_blur(kernels[k].kawase_down, kernels[k].kawase_up, pixels, width, height, sigmas[j]);
+                        const double elapsed = now_seconds() - start;
+                        if (elapsed < best)
+                            best = elapsed;
+                    }
+                    printf("  %s %7.1f MPix/s", kernels[k].name, width * height / best / 1e6);
+                }
+                printf("\n");
+            }
+        }
+        free(pixels);
+    }
+}
+
+void blur_impl_box_pass_generic(const uint32_t *src, int src_stride, uint32_t *dst, int dst_stride,
+                                int width, int height, int radius, const int *index, int row_start, int row_end) {
+    const int size = 2 * radius + 1;
+    // (sum + size / 2) * mul >> 40 rounds sum / size to the nearest integer
+    // for all sums of up to 255 * size
+    const uint64_t mul = ((1ULL << 40) + size - 1) / size;
 
-            for (i = 0; i < KERNEL_SIZE; i++) {
-                acc[0] += (rgbaIn[i] & 0xFF000000) >> 24;
-                acc[1] += (rgbaIn[i] & 0x00FF0000) >> 16;
-                acc[2] += (rgbaIn[i] & 0x0000FF00) >> 8;
-                acc[3] += (rgbaIn[i] & 0x000000FF) >> 0;
+    for (int row = row_start; row < row_end; row += BOX_ROWS) {
+        const int rows = row_end - row < BOX_ROWS ? row_end - row : BOX_ROWS;
+        const uint32_t *in = src + row * src_stride;
+        uint32_t acc[BOX_ROWS][4];
+
+        for (int r = 0; r < rows; r++) {
+            acc[r][0] = acc[r][1] = acc[r][2] = acc[r][3] = 0;
+            for (int k = 0; k < size; k++) {
+                uint32_t p = in[r * src_stride + index[k]];
+                acc[r][0] += (p & 0xFF000000) >> 24;
+                acc[r][1] += (p & 0x00FF0000) >> 16;
+                acc[r][2] += (p & 0x0000FF00) >> 8;
+                acc[r][3] += (p & 0x000000FF) >> 0;
             }
+        }
 
-            for(i = 0; i < 4; i++)
-                acc[i] *= 1.0/KERNEL_SIZE;
+        for (int column = 0; column < width; column++) {
+            uint32_t *out = dst + dst_stride * column + row;
+            const int add = index[column + size], sub = index[column];
+            for (int r = 0; r < rows; r++) {
+                uint32_t *a = acc[r];
+                out[r] = (uint32_t)(((a[0] + size / 2) * mul) >> 40) << 24 |
+                         (uint32_t)(((a[1] + size / 2) * mul) >> 40) << 16 |
+                         (uint32_t)(((a[2] + size / 2) * mul) >> 40) << 8 |
+                         (uint32_t)(((a[3] + size / 2) * mul) >> 40) << 0;
 
-            *(dst + height * column + row) = (acc[0] << 24) |
-                                             (acc[1] << 16) |
-                                             (acc[2] << 8 ) |
-                                             (acc[3] << 0);
+                // slide the window: add the pixel entering on the right,
+                // drop the one leaving on the left
+                uint32_t in_px = in[r * src_stride + add], out_px = in[r * src_stride + sub];
+                a[0] += ((in_px & 0xFF000000) >> 24) - ((out_px & 0xFF000000) >> 24);
+                a[1] += ((in_px & 0x00FF0000) >> 16) - ((out_px & 0x00FF0000) >> 16);
+                a[2] += ((in_px & 0x0000FF00) >> 8) - ((out_px & 0x0000FF00) >> 8);
+                a[3] += ((in_px & 0x000000FF) >> 0) - ((out_px & 0x000000FF) >> 0);
+            }
         }
     }
 }
+
+void blur_impl_gauss_pass_generic(const uint32_t *src, int src_stride, uint32_t *dst, int dst_stride,
+                                  int width, int height, int radius, const int *index, const int16_t *weights,
+                                  int row_start, int row_end) {
+    const int taps = 2 * radius + 1;
+    const int32_t round = 1 << (GAUSS_SHIFT - 1);
+
+    for (int row = row_start; row < row_end; row += BOX_ROWS) {
+        const int rows = row_end - row < BOX_ROWS ? row_end - row : BOX_ROWS;
+        const uint32_t *in = src + row * src_stride;
+
+        for (int column = 0; column < width; column++) {
+            uint32_t *out = dst + dst_stride * column + row;
+            const int *tap = index + column;
+            for (int r = 0; r < rows; r++) {
+                const uint32_t *line = in + r * src_stride;
+                int32_t sum[4] = {round, round, round, round};
+                for (int k = 0; k < taps; k++) {
+                    const uint32_t p = line[tap[k]];
+                    sum[0] += weights[k] * (int32_t)((p >> 24) & 0xFF);
+                    sum[1] += weights[k] * (int32_t)((p >> 16) & 0xFF);
+                    sum[2] += weights[k] * (int32_t)((p >> 8) & 0xFF);
+                    sum[3] += weights[k] * (int32_t)((p >> 0) & 0xFF);
+                }
+                out[r] = (uint32_t)(sum[0] >> GAUSS_SHIFT) << 24 |
+                         (uint32_t)(sum[1] >> GAUSS_SHIFT) << 16 |
+                         (uint32_t)(sum[2] >> GAUSS_SHIFT) << 8 |
+                         (uint32_t)(sum[3] >> GAUSS_SHIFT) << 0;
+            }
+        }
+    }
+}
+
+void blur_impl_kawase_down_generic(const uint32_t *above, const uint32_t *top, const uint32_t *bottom,
+                                   const uint32_t *below, uint32_t *out, int start, int end) {
+    for (int x = start; x < end; x++) {
+        const int sx = 2 * x;
+        uint64_t sum = widen_pixel(top[sx]) + widen_pixel(top[sx + 1]) +
+                       widen_pixel(bottom[sx]) + widen_pixel(bottom[sx + 1]) +
+                       widen_pixel(above[sx - 1]) + widen_pixel(above[sx + 2]) +
+                       widen_pixel(below[sx - 1]) + widen_pixel(below[sx + 2]);
+        out[x] = narrow_pixel(sum, 3);
+    }
+}
+
+void blur_impl_kawase_up_generic(const uint32_t *near, const uint32_t *far, uint32_t *out, int start, int end) {
+    for (int k = start; k < end; k++) {
+        // blend the rows first, then the columns
+        const uint64_t left = 3 * widen_pixel(near[k - 1]) + widen_pixel(far[k - 1]);
+        const uint64_t center = 3 * widen_pixel(near[k]) + widen_pixel(far[k]);
+        const uint64_t right = 3 * widen_pixel(near[k + 1]) + widen_pixel(far[k + 1]);
+        out[2 * k] = narrow_pixel(3 * center + left, 4);
+        out[2 * k + 1] = narrow_pixel(3 * center + right, 4);
+    }
+}
@@ -4,13 +4,88 @@
 #include <stdint.h>
 #include <cairo.h>
 
-#define KERNEL_SIZE 7
-#define SIGMA_AV 2
-#define HALF_KERNEL KERNEL_SIZE / 2
+/* number of box filter passes used to approximate a Gaussian */
+#define BOX_PASSES 3
+/* rows blurred together by the box pass kernels: one 64 byte cache line of
+ * output per column */
+#define BOX_ROWS 16
+
+typedef enum {
+    BLUR_BOX,         /* three box passes approximating a Gaussian */
+    BLUR_GAUSSIAN,    /* an exact (truncated) separable Gaussian */
+    BLUR_DUAL_KAWASE, /* repeated half resolution down- and upsampling */
+} blur_mode_t;
 
 void blur_image_surface(cairo_surface_t *surface, int sigma);
+void blur_image_region(cairo_surface_t *surface, const cairo_rectangle_int_t *rect, int sigma);
+void pixelate_image_surface(cairo_surface_t *surface, int block);
+
+/*
+ * Prints the throughput of each blur with each kernel, checks that the SIMD
+ * kernels match the generic ones bit for bit and reports the error of the
+ * blurs against an exact Gaussian.
+ */
+void blur_benchmark(void);
+
+/*
+ * The box pass kernels blur rows [row_start, row_end) of the width x height
+ * image src with a box of 2 * radius + 1 pixels and write them transposed
+ * into dst, so different row ranges can be blurred concurrently. Strides are
+ * in pixels. index maps window offsets to (mirrored) columns, see
+ * create_box_index().
+ *
+ * When dst is 64 byte aligned and dst_stride is a multiple of BOX_ROWS, the
+ * SIMD kernels write whole cache lines with non-temporal stores.
+ */
+#ifdef __SSE2__
+void blur_impl_box_pass_sse2(const uint32_t *src, int src_stride, uint32_t *dst, int dst_stride,
+                             int width, int height, int radius, const int *index, int row_start, int row_end);
+#endif
+void blur_impl_box_pass_generic(const uint32_t *src, int src_stride, uint32_t *dst, int dst_stride,
+                                int width, int height, int radius, const int *index, int row_start, int row_end);
+
+/*
+ * The Gaussian pass kernels work like the box pass kernels, but convolve with
+ * the 2 * radius + 1 weights (fixed point, summing to 1 << GAUSS_SHIFT).
+ * weights has one more entry, which must be 0, so that taps come in pairs.
+ */
+#define GAUSS_SHIFT 14
 #ifdef __SSE2__
-void blur_impl_horizontal_pass_sse2(uint32_t *src, uint32_t *dst, int width, int height);
+void blur_impl_gauss_pass_sse2(const uint32_t *src, int src_stride, uint32_t *dst, int dst_stride,
+                               int width, int height, int radius, const int *index, const int16_t *weights,
+                               int row_start, int row_end);
+#endif
+void blur_impl_gauss_pass_generic(const uint32_t *src, int src_stride, uint32_t *dst, int dst_stride,
+                                  int width, int height, int radius, const int *index, const int16_t *weights,
+                                  int row_start, int row_end);
+
+/*
+ * The dual filter kernels compute the output pixels [start, end) of one row.
+ * The down kernels average the 2x2 block of top and bottom under each pixel
+ * and the diagonal neighbours in the rows above and below; the up kernels
+ * compute the pixel pairs 2k, 2k + 1 of a row twice as wide from the nearest
+ * (near) and the next nearest (far) row with weights 9, 3, 3 and 1. Neither
+ * clamps at the edges: every pixel read must be inside the rows.
+ */
+#ifdef __SSE2__
+void blur_impl_kawase_down_sse2(const uint32_t *above, const uint32_t *top, const uint32_t *bottom,
+                                const uint32_t *below, uint32_t *out, int start, int end);
+void blur_impl_kawase_up_sse2(const uint32_t *near, const uint32_t *far, uint32_t *out, int start, int end);
+#endif
+void blur_impl_kawase_down_generic(const uint32_t *above, const uint32_t *top, const uint32_t *bottom,
+                                   const uint32_t *below, uint32_t *out, int start, int end);
+void blur_impl_kawase_up_generic(const uint32_t *near, const uint32_t *far, uint32_t *out, int start, int end);
+
+/*
+ * wider kernels, compiled in on x86 and picked at runtime if the CPU has them.
+ * The AVX2 box pass blurs 2 * BOX_ROWS rows at a time.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BLUR_X86_DISPATCH
+void blur_impl_box_pass_avx2(const uint32_t *src, int src_stride, uint32_t *dst, int dst_stride,
+                             int width, int height, int radius, const int *index, int row_start, int row_end);
+void blur_impl_gauss_pass_avx2(const uint32_t *src, int src_stride, uint32_t *dst, int dst_stride,
+                               int width, int height, int radius, const int *index, const int16_t *weights,
+                               int row_start, int row_end);
 #endif
-void blur_impl_horizontal_pass_generic(uint32_t *src, uint32_t *dst, int width, int height);
 #endif
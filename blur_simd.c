@@ -7,73 +7,302 @@
  *
  */
 
+#include <stdbool.h>
+#include <string.h>
 
-// number of xmm registers needed to store input pixels for given kernel size
-#ifdef __SSE2__
 #include "blur.h"
-#define REGISTERS_CNT (KERNEL_SIZE + 4/2) / 4
-#include <xmmintrin.h>
-void blur_impl_horizontal_pass_sse2(uint32_t *src, uint32_t *dst, int width, int height) {
-    uint32_t* o_src = src;
-    for (int row = 0; row < height; row++) {
-        for (int column = 0; column < width; column++, src++) {
-            __m128i rgbaIn[REGISTERS_CNT];
-
-            // handle borders
-            int leftBorder = column < HALF_KERNEL;
-            int rightBorder = column > width - HALF_KERNEL;
-            uint32_t _rgbaIn[KERNEL_SIZE + 1] __attribute__((aligned(16)));
-            int i = 0;
-            if (leftBorder) {
-                // for kernel size 7x7 and column == 0, we have:
-                // x x x P0 P1 P2 P3
-                // first loop mirrors P{0..3} to fill x's,
-                // second one loads P{0..3}
-                for (; i < HALF_KERNEL - column; i++)
-                    _rgbaIn[i] = *(src + (HALF_KERNEL - i));
-                for (; i < KERNEL_SIZE; i++)
-                    _rgbaIn[i] = *(src - (HALF_KERNEL - i));
-
-                for (int k = 0; k < REGISTERS_CNT; k++)
-                    rgbaIn[k] = _mm_load_si128((__m128i*)(_rgbaIn + 4*k));
-            } else if (rightBorder) {
-                for (; i < width - column; i++)
-                    _rgbaIn[i] = *(src + i);
-                for (int k = 0; i < KERNEL_SIZE; i++, k++)
-                    _rgbaIn[i] = *(src - k);
-
-                for (int k = 0; k < REGISTERS_CNT; k++)
-                    rgbaIn[k] = _mm_load_si128((__m128i*)(_rgbaIn + 4*k));
+
+/* Whether a BOX_ROWS output run at dst + row may be written as whole cache lines. */
+static inline bool stream_output(const uint32_t *dst, int dst_stride, int row, int rows) {
+    return rows == BOX_ROWS && dst_stride % BOX_ROWS == 0 && ((uintptr_t)(dst + row) & 63) == 0;
+}
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+/* Expands the 4 channels of a pixel to 32 bit each. */
+static inline __m128i unpack_pixel(uint32_t pixel) {
+    const __m128i zero = _mm_setzero_si128();
+    return _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(pixel), zero), zero);
+}
+
+void blur_impl_box_pass_sse2(const uint32_t *src, int src_stride, uint32_t *dst, int dst_stride,
+                             int width, int height, int radius, const int *index, int row_start, int row_end) {
+    const int size = 2 * radius + 1;
+    const __m128i zero = _mm_setzero_si128();
+    // multiplication is significantly faster than division
+    const __m128 reciprocal = _mm_set1_ps(1.0f / size);
+
+    for (int row = row_start; row < row_end; row += BOX_ROWS) {
+        const int rows = row_end - row < BOX_ROWS ? row_end - row : BOX_ROWS;
+        const bool stream = stream_output(dst, dst_stride, row, rows);
+        const uint32_t *in = src + row * src_stride;
+        __m128i acc[BOX_ROWS];
+        // one output column, collected in L1 and written out as a whole line
+        uint32_t tile[BOX_ROWS] __attribute__((aligned(16)));
+
+        for (int r = 0; r < rows; r++) {
+            acc[r] = zero;
+            for (int k = 0; k < size; k++)
+                acc[r] = _mm_add_epi32(acc[r], unpack_pixel(in[r * src_stride + index[k]]));
+        }
+
+        for (int column = 0; column < width; column++) {
+            uint32_t *out = dst + dst_stride * column + row;
+            const int add = index[column + size], sub = index[column];
+            for (int r = 0; r < rows; r++) {
+                __m128i v = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(acc[r]), reciprocal));
+                tile[r] = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packs_epi32(v, zero), zero));
+
+                acc[r] = _mm_add_epi32(acc[r], _mm_sub_epi32(unpack_pixel(in[r * src_stride + add]),
+                                                             unpack_pixel(in[r * src_stride + sub])));
+            }
+            if (stream) {
+                for (int i = 0; i < BOX_ROWS / 4; i++)
+                    _mm_stream_si128((__m128i *)out + i, _mm_load_si128((const __m128i *)tile + i));
+            } else {
+                memcpy(out, tile, rows * sizeof(uint32_t));
+            }
+        }
+    }
+    // order the non-temporal stores before the pass is handed on
+    _mm_sfence();
+}
+
+/* Interleaves the channels of two pixels as 16 bit words: a0 b0 a1 b1 ... */
+static inline __m128i interleave_pixels(uint32_t a, uint32_t b) {
+    return _mm_unpacklo_epi8(_mm_unpacklo_epi8(_mm_cvtsi32_si128(a), _mm_cvtsi32_si128(b)), _mm_setzero_si128());
+}
+
+void blur_impl_gauss_pass_sse2(const uint32_t *src, int src_stride, uint32_t *dst, int dst_stride,
+                               int width, int height, int radius, const int *index, const int16_t *weights,
+                               int row_start, int row_end) {
+    const int pairs = radius + 1;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32(1 << (GAUSS_SHIFT - 1));
+
+    // each 32 bit lane holds the weights of two neighbouring taps, so that
+    // one madd applies both to all four channels
+    __m128i pair_weights[pairs];
+    for (int k = 0; k < pairs; k++)
+        pair_weights[k] = _mm_set1_epi32((uint16_t)weights[2 * k] | (uint32_t)(uint16_t)weights[2 * k + 1] << 16);
+
+    for (int row = row_start; row < row_end; row += BOX_ROWS) {
+        const int rows = row_end - row < BOX_ROWS ? row_end - row : BOX_ROWS;
+        const bool stream = stream_output(dst, dst_stride, row, rows);
+        const uint32_t *in = src + row * src_stride;
+        uint32_t tile[BOX_ROWS] __attribute__((aligned(16)));
+
+        for (int column = 0; column < width; column++) {
+            uint32_t *out = dst + dst_stride * column + row;
+            const int *tap = index + column;
+            for (int r = 0; r < rows; r++) {
+                const uint32_t *line = in + r * src_stride;
+                __m128i sum = round;
+                for (int k = 0; k < pairs; k++)
+                    sum = _mm_add_epi32(sum, _mm_madd_epi16(interleave_pixels(line[tap[2 * k]], line[tap[2 * k + 1]]),
+                                                            pair_weights[k]));
+                sum = _mm_srai_epi32(sum, GAUSS_SHIFT);
+                tile[r] = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packs_epi32(sum, zero), zero));
+            }
+            if (stream) {
+                for (int i = 0; i < BOX_ROWS / 4; i++)
+                    _mm_stream_si128((__m128i *)out + i, _mm_load_si128((const __m128i *)tile + i));
             } else {
-                for (int k = 0; k < REGISTERS_CNT; k++) {
-                    if ((uintptr_t) (((__m128i*) src + 4*k - HALF_KERNEL) + 1)
-                            > (uintptr_t) (o_src + (height * width)))
-                        break;
-                    rgbaIn[k] = _mm_loadu_si128((__m128i*)(src + 4*k - HALF_KERNEL));
+                memcpy(out, tile, rows * sizeof(uint32_t));
+            }
+        }
+    }
+    _mm_sfence();
+}
+
+/* Sums the two pixels (16 bit channels) of a into the low and those of b into the high half. */
+static inline __m128i add_halves(__m128i a, __m128i b) {
+    return _mm_add_epi16(_mm_unpacklo_epi64(a, b), _mm_unpackhi_epi64(a, b));
+}
+
+void blur_impl_kawase_down_sse2(const uint32_t *above, const uint32_t *top, const uint32_t *bottom,
+                                const uint32_t *below, uint32_t *out, int start, int end) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi16(4);
+    int x = start;
+    // two output pixels per iteration, one in each half of the sums
+    for (; x + 2 <= end; x += 2) {
+        __m128i sum = round;
+        const uint32_t *block[2] = {top, bottom};
+        for (int i = 0; i < 2; i++) {
+            const __m128i v = _mm_loadu_si128((const __m128i *)(block[i] + 2 * x));
+            sum = _mm_add_epi16(sum, add_halves(_mm_unpacklo_epi8(v, zero), _mm_unpackhi_epi8(v, zero)));
+        }
+        // the corners of the first pixel are columns 2x - 1 and 2x + 2, those
+        // of the second 2x + 1 and 2x + 4
+        const uint32_t *corner[2] = {above, below};
+        for (int i = 0; i < 2; i++) {
+            const __m128i a = _mm_loadu_si128((const __m128i *)(corner[i] + 2 * x - 1));
+            const __m128i b = _mm_loadu_si128((const __m128i *)(corner[i] + 2 * x + 1));
+            sum = _mm_add_epi16(sum, _mm_add_epi16(_mm_unpacklo_epi64(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero)),
+                                                   _mm_unpackhi_epi64(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero))));
+        }
+        sum = _mm_srli_epi16(sum, 3);
+        _mm_storel_epi64((__m128i *)(out + x), _mm_packus_epi16(sum, sum));
+    }
+    if (x < end)
+        blur_impl_kawase_down_generic(above, top, bottom, below, out, x, end);
+}
+
+/* 3 * a + b for the 16 bit channels of two pixels. */
+static inline __m128i weigh_3_1(__m128i a, __m128i b) {
+    return _mm_add_epi16(_mm_add_epi16(a, _mm_add_epi16(a, a)), b);
+}
+
+void blur_impl_kawase_up_sse2(const uint32_t *near, const uint32_t *far, uint32_t *out, int start, int end) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi16(8);
+    int k = start;
+    // four output pixels from the columns k - 1 to k + 2 per iteration: the
+    // rows are blended first (c = 3 near + far), then the columns
+    for (; k + 2 <= end; k += 2) {
+        const __m128i a = _mm_loadu_si128((const __m128i *)(near + k - 1));
+        const __m128i b = _mm_loadu_si128((const __m128i *)(far + k - 1));
+        const __m128i c_lo = weigh_3_1(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+        const __m128i c_hi = weigh_3_1(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+        // pixels 2k, 2k + 1: c[k] with c[k - 1] and c[k + 1]
+        __m128i first = weigh_3_1(_mm_unpackhi_epi64(c_lo, c_lo), _mm_unpacklo_epi64(c_lo, c_hi));
+        // pixels 2k + 2, 2k + 3: c[k + 1] with c[k] and c[k + 2]
+        __m128i second = weigh_3_1(_mm_unpacklo_epi64(c_hi, c_hi), _mm_unpackhi_epi64(c_lo, c_hi));
+        first = _mm_srli_epi16(_mm_add_epi16(first, round), 4);
+        second = _mm_srli_epi16(_mm_add_epi16(second, round), 4);
+        _mm_storeu_si128((__m128i *)(out + 2 * k), _mm_packus_epi16(first, second));
+    }
+    if (k < end)
+        blur_impl_kawase_up_generic(near, far, out, k, end);
+}
+#endif
+
+#ifdef BLUR_X86_DISPATCH
+#include <immintrin.h>
+
+/* The channels of two pixels of two rows, interleaved per row as for madd. */
+__attribute__((target("avx2")))
+static inline __m256i interleave_pixel_pairs(uint32_t a_low, uint32_t b_low, uint32_t a_high, uint32_t b_high) {
+    const __m256i order = _mm256_setr_epi8(0, 1, 8, 9, 2, 3, 10, 11, 4, 5, 12, 13, 6, 7, 14, 15,
+                                           0, 1, 8, 9, 2, 3, 10, 11, 4, 5, 12, 13, 6, 7, 14, 15);
+    return _mm256_shuffle_epi8(_mm256_cvtepu8_epi16(_mm_set_epi32(b_high, a_high, b_low, a_low)), order);
+}
+
+/* The channels of a pixel of two rows, one row per 128 bit lane. */
+__attribute__((target("avx2")))
+static inline __m256i widen_pixel_pair(uint32_t low, uint32_t high) {
+    return _mm256_cvtepu8_epi32(_mm_set_epi32(0, 0, high, low));
+}
+
+/*
+ * Blurs 2 * BOX_ROWS rows at a time, two rows per register, so that each
+ * column ends in four full 256 bit stores. Rounds like the SSE2 kernel.
+ */
+__attribute__((target("avx2")))
+void blur_impl_box_pass_avx2(const uint32_t *src, int src_stride, uint32_t *dst, int dst_stride,
+                             int width, int height, int radius, const int *index, int row_start, int row_end) {
+    const int size = 2 * radius + 1;
+    const __m256 reciprocal = _mm256_set1_ps(1.0f / size);
+    const __m256i row_order = _mm256_set_epi32(7, 3, 6, 2, 5, 1, 4, 0);
+
+    int row = row_start;
+    for (; row + 2 * BOX_ROWS <= row_end; row += 2 * BOX_ROWS) {
+        const bool stream = stream_output(dst, dst_stride, row, BOX_ROWS);
+        const uint32_t *in = src + row * src_stride;
+        __m256i acc[BOX_ROWS];
+
+        for (int i = 0; i < BOX_ROWS; i++) {
+            const uint32_t *low = in + 2 * i * src_stride, *high = low + src_stride;
+            acc[i] = _mm256_setzero_si256();
+            for (int k = 0; k < size; k++)
+                acc[i] = _mm256_add_epi32(acc[i], widen_pixel_pair(low[index[k]], high[index[k]]));
+        }
+
+        for (int column = 0; column < width; column++) {
+            __m256i *out = (__m256i *)(dst + dst_stride * column + row);
+            const int add = index[column + size], sub = index[column];
+            for (int quarter = 0; quarter < BOX_ROWS / 4; quarter++) {
+                __m256i v[4];
+                for (int i = 0; i < 4; i++) {
+                    __m256i *a = &acc[4 * quarter + i];
+                    const uint32_t *low = in + 2 * (4 * quarter + i) * src_stride, *high = low + src_stride;
+                    v[i] = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(*a), reciprocal));
+                    *a = _mm256_add_epi32(*a, _mm256_sub_epi32(widen_pixel_pair(low[add], high[add]),
+                                                               widen_pixel_pair(low[sub], high[sub])));
                 }
+                __m256i packed = _mm256_packus_epi16(_mm256_packs_epi32(v[0], v[1]),
+                                                     _mm256_packs_epi32(v[2], v[3]));
+                packed = _mm256_permutevar8x32_epi32(packed, row_order);
+                if (stream)
+                    _mm256_stream_si256(out + quarter, packed);
+                else
+                    _mm256_storeu_si256(out + quarter, packed);
             }
+        }
+    }
+    _mm_sfence();
 
-            __m128i zero = _mm_setzero_si128();
-            __m128i acc = _mm_setzero_si128();
+    if (row < row_end) {
+#ifdef __SSE2__
+        blur_impl_box_pass_sse2(src, src_stride, dst, dst_stride, width, height, radius, index, row, row_end);
+#else
+        blur_impl_box_pass_generic(src, src_stride, dst, dst_stride, width, height, radius, index, row, row_end);
+#endif
+    }
+}
 
-            acc = _mm_add_epi16(acc, _mm_unpacklo_epi8(rgbaIn[0], zero));
-            acc = _mm_add_epi16(acc, _mm_unpackhi_epi8(rgbaIn[0], zero));
-            acc = _mm_add_epi16(acc, _mm_unpacklo_epi8(rgbaIn[1], zero));
+__attribute__((target("avx2")))
+void blur_impl_gauss_pass_avx2(const uint32_t *src, int src_stride, uint32_t *dst, int dst_stride,
+                               int width, int height, int radius, const int *index, const int16_t *weights,
+                               int row_start, int row_end) {
+    const int pairs = radius + 1;
+    const __m256i round = _mm256_set1_epi32(1 << (GAUSS_SHIFT - 1));
+    const __m256i row_order = _mm256_set_epi32(7, 3, 6, 2, 5, 1, 4, 0);
 
-            // kernel size equals to 7, but we can only load multiples of 4 pixels
-            // we have to set 8th pixel to zero
-            acc = _mm_add_epi16(acc, _mm_andnot_si128(_mm_set_epi32(0xFFFFFFFF, 0xFFFFFFFF, 0, 0),
-                                                      _mm_unpackhi_epi8(rgbaIn[1], zero)));
-            acc = _mm_add_epi32(_mm_unpacklo_epi16(acc, zero),
-                                _mm_unpackhi_epi16(acc, zero));
+    __m256i pair_weights[pairs];
+    for (int k = 0; k < pairs; k++)
+        pair_weights[k] = _mm256_set1_epi32((uint16_t)weights[2 * k] | (uint32_t)(uint16_t)weights[2 * k + 1] << 16);
 
-            // multiplication is significantly faster than division
-            acc = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(acc),
-                                             _mm_set1_ps(1.0/KERNEL_SIZE)));
+    int row = row_start;
+    for (; row + BOX_ROWS <= row_end; row += BOX_ROWS) {
+        const bool stream = stream_output(dst, dst_stride, row, BOX_ROWS);
+        const uint32_t *in = src + row * src_stride;
 
-            *(dst + height * column + row) =
-                _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packs_epi32(acc, zero), zero));
+        for (int column = 0; column < width; column++) {
+            __m256i *out = (__m256i *)(dst + dst_stride * column + row);
+            const int *tap = index + column;
+            for (int half = 0; half < BOX_ROWS / 8; half++) {
+                __m256i v[4];
+                for (int i = 0; i < 4; i++) {
+                    const uint32_t *low = in + 2 * (4 * half + i) * src_stride, *high = low + src_stride;
+                    __m256i sum = round;
+                    for (int k = 0; k < pairs; k++) {
+                        const int a = tap[2 * k], b = tap[2 * k + 1];
+                        sum = _mm256_add_epi32(sum, _mm256_madd_epi16(interleave_pixel_pairs(low[a], low[b], high[a], high[b]),
+                                                                      pair_weights[k]));
+                    }
+                    v[i] = _mm256_srai_epi32(sum, GAUSS_SHIFT);
+                }
+                __m256i packed = _mm256_packus_epi16(_mm256_packs_epi32(v[0], v[1]),
+                                                     _mm256_packs_epi32(v[2], v[3]));
+                packed = _mm256_permutevar8x32_epi32(packed, row_order);
+                if (stream)
+                    _mm256_stream_si256(out + half, packed);
+                else
+                    _mm256_storeu_si256(out + half, packed);
+            }
         }
     }
+    _mm_sfence();
+
+    if (row < row_end) {
+#ifdef __SSE2__
+        blur_impl_gauss_pass_sse2(src, src_stride, dst, dst_stride, width, height, radius, index, weights, row, row_end);
+#else
+        blur_impl_gauss_pass_generic(src, src_stride, dst, dst_stride, width, height, radius, index, weights, row, row_end);
+#endif
+    }
 }
 #endif
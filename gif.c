@@ -0,0 +1,578 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * gif.c: decodes animated GIFs frame by frame into the rectangles that
+ *        change from frame to frame, a few frames ahead on a worker
+ *        thread, and plays them back on two canvas surfaces.
+ *
+ * See LICENSE for licensing information
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <gif_lib.h>
+
+#include "i3lock.h"
+#include "gif.h"
+
+extern bool debug_mode;
+
+/* A rectangle of the canvas, right and bottom exclusive. */
+typedef struct {
+    int left, top, right, bottom;
+} gif_rect_t;
+
+/* how many frames the worker decodes ahead of the one shown */
+#define GIF_DECODE_AHEAD 4
+
+/* Like browsers do, frames with delays of 10 ms or less (including none at
+ * all) are shown for 100 ms instead. Delays are in 1/100 s. */
+#define GIF_MIN_DELAY 1
+#define GIF_DEFAULT_DELAY 10
+
+/*
+ * A frame, stored as the part of the canvas that differs from the previous
+ * frame. The first frame covers the whole canvas, so that applying it
+ * restarts the animation from any frame.
+ */
+typedef struct {
+    gif_rect_t rect;
+    /* the pixels of rect, rows packed without padding */
+    uint32_t *pixels;
+    double delay;
+    /* position in the file, 0 for the first frame */
+    int index;
+} gif_frame_t;
+
+/*
+ * Decoding state. Only gif_load() and then the worker (or, without one,
+ * gif_next_frame()) use it.
+ */
+static struct {
+    image_file_t file;
+    image_reader_t reader;
+    GifFileType *gif;
+    int width, height;
+    uint32_t bg_color;
+    /* the picture the next frame is drawn over, i.e. the last frame after
+     * its disposal, and what a frame with DISPOSE_PREVIOUS covered */
+    uint32_t *canvas, *saved;
+    GifByteType *line;
+    int line_size;
+    /* what the disposal of the previous frame changed */
+    gif_rect_t disposed;
+    int next_index;
+} decoder;
+
+/* Frames decoded ahead, oldest first. */
+static gif_frame_t queue[GIF_DECODE_AHEAD];
+static int queue_head = 0, queue_length = 0;
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t worker;
+static bool worker_running = false;
+/* tells the worker to exit, see gif_unload() */
+static bool worker_stop = false;
+/* set by the worker when it could not decode another frame and exited */
+static bool worker_failed = false;
+static bool animated = false;
+
+/* Frames are drawn into the canvas that is not shown, so that a redraw
+ * still reading the shown one never sees half a frame. The back canvas is
+ * one frame behind, so the last frame shown is kept to catch it up. */
+static cairo_surface_t *canvases[2];
+static int front = 0;
+static gif_frame_t shown;
+
+static bool rect_empty(gif_rect_t rect) {
+    return rect.right <= rect.left || rect.bottom <= rect.top;
+}
+
+static gif_rect_t rect_union(gif_rect_t a, gif_rect_t b) {
+    if (rect_empty(a))
+        return b;
+    if (rect_empty(b))
+        return a;
+    gif_rect_t rect = {
+        a.left < b.left ? a.left : b.left,
+        a.top < b.top ? a.top : b.top,
+        a.right > b.right ? a.right : b.right,
+        a.bottom > b.bottom ? a.bottom : b.bottom};
+    return rect;
+}
+
+static int read_gif_data(GifFileType *gif, GifByteType *data, int length) {
+    return image_reader_read(gif->UserData, data, length);
+}
+
+/*
+ * Converts a GIF colour map into RGB24 pixels, so that decoding a pixel is a
+ * single table lookup. Indices beyond the map are black.
+ */
+static void gif_palette(const ColorMapObject *cmap, uint32_t palette[256]) {
+    memset(palette, 0, 256 * sizeof(uint32_t));
+    if (cmap == NULL)
+        return;
+    const int count = cmap->ColorCount < 256 ? cmap->ColorCount : 256;
+    for (int i = 0; i < count; i++) {
+        const GifColorType *rgb = cmap->Colors + i;
+        palette[i] = rgb->Blue | rgb->Green << 8 | rgb->Red << 16;
+    }
+}
+
+/* The part of a frame that lies within the canvas. */
+static gif_rect_t gif_frame_rect(const GifImageDesc *desc, int width, int height) {
+    gif_rect_t rect = {desc->Left, desc->Top, desc->Left + desc->Width, desc->Top + desc->Height};
+    if (rect.left < 0) rect.left = 0;
+    if (rect.top < 0) rect.top = 0;
+    if (rect.right > width) rect.right = width;
+    if (rect.bottom > height) rect.bottom = height;
+    if (rect.right < rect.left) rect.right = rect.left;
+    if (rect.bottom < rect.top) rect.bottom = rect.top;
+    return rect;
+}
+
+/*
+ * Draws one row of colour indices. A transparent index keeps the canvas
+ * pixel; it is mapped to itself so that the loop stays branch free.
+ */
+static void gif_draw_row(uint32_t *dst, const GifByteType *src, int count,
+                         const uint32_t palette[256], int transparent) {
+    if (transparent < 0 || transparent > 255) {
+        for (int x = 0; x < count; x++)
+            dst[x] = palette[src[x]];
+    } else {
+        for (int x = 0; x < count; x++)
+            dst[x] = src[x] == transparent ? dst[x] : palette[src[x]];
+    }
+}
+
+static void gif_fill_rect(uint32_t *canvas, int stride, gif_rect_t rect, uint32_t color) {
+    for (int y = rect.top; y < rect.bottom; y++)
+        for (int x = rect.left; x < rect.right; x++)
+            canvas[y * stride + x] = color;
+}
+
+/* Copies rect between two buffers with rows of dst_stride and src_stride pixels. */
+static void gif_copy_rect(uint32_t *dst, int dst_stride, const uint32_t *src, int src_stride, gif_rect_t rect) {
+    for (int y = rect.top; y < rect.bottom; y++)
+        memcpy(dst + (size_t)y * dst_stride + rect.left, src + (size_t)y * src_stride + rect.left,
+               (rect.right - rect.left) * sizeof(uint32_t));
+}
+
+/*
+ * Stores rect of the canvas as the given frame.
+ */
+static bool store_frame(gif_frame_t *frame, const uint32_t *canvas, int stride, gif_rect_t rect) {
+    frame->rect = rect;
+    frame->pixels = NULL;
+    if (rect_empty(rect))
+        return true;
+
+    const int width = rect.right - rect.left;
+    frame->pixels = malloc((size_t)width * (rect.bottom - rect.top) * sizeof(uint32_t));
+    if (frame->pixels == NULL)
+        return false;
+    /* pixels is addressed like a canvas which starts at rect's top left corner */
+    gif_rect_t local = {0, 0, width, rect.bottom - rect.top};
+    gif_copy_rect(frame->pixels, width, canvas + (size_t)rect.top * stride + rect.left, stride, local);
+    return true;
+}
+
+/*
+ * Writes a frame's pixels into a canvas surface.
+ */
+static void apply_frame(cairo_surface_t *surface, const gif_frame_t *frame) {
+    if (frame->pixels == NULL)
+        return;
+
+    uint32_t *data = (uint32_t *)cairo_image_surface_get_data(surface);
+    const int stride = cairo_image_surface_get_stride(surface) / sizeof(uint32_t);
+    const gif_rect_t rect = frame->rect;
+    const int width = rect.right - rect.left;
+    gif_rect_t local = {0, 0, width, rect.bottom - rect.top};
+    gif_copy_rect(data + (size_t)rect.top * stride + rect.left, stride, frame->pixels, width, local);
+}
+
+/*
+ * Maps the n-th line stored in an interlaced image to its row: every 8th row
+ * from 0, every 8th from 4, every 4th from 2 and finally every 2nd from 1.
+ */
+static int interlaced_row(int line, int height) {
+    static const int start[] = {0, 4, 2, 1};
+    static const int step[] = {8, 8, 4, 2};
+    for (int pass = 0; pass < 4; pass++) {
+        const int rows = (height - start[pass] + step[pass] - 1) / step[pass];
+        if (line < rows)
+            return start[pass] + line * step[pass];
+        line -= rows;
+    }
+    return line;
+}
+
+static bool open_decoder(void) {
+    int err;
+    decoder.reader = (image_reader_t){&decoder.file, 0};
+    decoder.gif = DGifOpen(&decoder.reader, read_gif_data, &err);
+    if (!decoder.gif) {
+        fprintf(stderr, "Could not open GIF file, (Error %d)\n", err);
+        return false;
+    }
+    decoder.disposed = (gif_rect_t){0, 0, decoder.width, decoder.height};
+    decoder.next_index = 0;
+    if (decoder.canvas)
+        gif_fill_rect(decoder.canvas, decoder.width, decoder.disposed, decoder.bg_color);
+    return true;
+}
+
+static void close_decoder(void) {
+    int err;
+    if (decoder.gif && !DGifCloseFile(decoder.gif, &err)) {
+        DEBUG("DGifCloseFile call failed, (Error %d)\n", err);
+    }
+    decoder.gif = NULL;
+}
+
+/* Frees everything decoding needs, once all frames are known. */
+static void free_decoder(void) {
+    close_decoder();
+    free(decoder.canvas);
+    free(decoder.saved);
+    free(decoder.line);
+    image_file_close(&decoder.file);
+    memset(&decoder, 0, sizeof(decoder));
+}
+
+/*
+ * Reads the lines of the image whose descriptor was just read and draws
+ * them over the canvas, then stores the frame.
+ */
+static bool decode_image(const GraphicsControlBlock *gc, gif_frame_t *frame) {
+    const GifImageDesc *desc = &decoder.gif->Image;
+    const int width = decoder.width;
+    uint32_t palette[256];
+
+    /* A local colour map replaces the global one for this frame */
+    gif_palette(desc->ColorMap ? desc->ColorMap : decoder.gif->SColorMap, palette);
+
+    if (desc->Width > decoder.line_size) {
+        GifByteType *line = realloc(decoder.line, desc->Width);
+        if (line == NULL)
+            return false;
+        decoder.line = line;
+        decoder.line_size = desc->Width;
+    }
+
+    const gif_rect_t rect = gif_frame_rect(desc, width, decoder.height);
+    if (gc->DisposalMode == DISPOSE_PREVIOUS)
+        gif_copy_rect(decoder.saved, width, decoder.canvas, width, rect);
+
+    /* Only the frame's own rectangle changes, row by row */
+    for (int i = 0; i < desc->Height; i++) {
+        if (DGifGetLine(decoder.gif, decoder.line, desc->Width) == GIF_ERROR)
+            return false;
+        const int y = desc->Top + (desc->Interlace ? interlaced_row(i, desc->Height) : i);
+        if (y < rect.top || y >= rect.bottom)
+            continue;
+        gif_draw_row(decoder.canvas + (size_t)y * width + rect.left, decoder.line + (rect.left - desc->Left),
+                     rect.right - rect.left, palette, gc->TransparentColor);
+    }
+
+    const gif_rect_t full = {0, 0, width, decoder.height};
+    if (!store_frame(frame, decoder.canvas, width,
+                     decoder.next_index == 0 ? full : rect_union(rect, decoder.disposed)))
+        return false;
+    // Delay time is in 1/100 s. Scale it to seconds.
+    frame->delay = (gc->DelayTime <= GIF_MIN_DELAY ? GIF_DEFAULT_DELAY : gc->DelayTime) * 0.01;
+    frame->index = decoder.next_index++;
+
+    /* Dispose of the frame before the next one is drawn */
+    decoder.disposed = (gif_rect_t){0, 0, 0, 0};
+    if (gc->DisposalMode == DISPOSE_BACKGROUND) {
+        gif_fill_rect(decoder.canvas, width, rect, decoder.bg_color);
+        decoder.disposed = rect;
+    } else if (gc->DisposalMode == DISPOSE_PREVIOUS) {
+        gif_copy_rect(decoder.canvas, width, decoder.saved, width, rect);
+        decoder.disposed = rect;
+    }
+    return true;
+}
+
+/*
+ * Decodes the next frame, starting over with the first one at the end of
+ * the file (or at a broken frame). Returns false if no frame can be decoded.
+ */
+static bool decode_next_frame(gif_frame_t *frame) {
+    GraphicsControlBlock gc = {DISPOSAL_UNSPECIFIED, false, 0, NO_TRANSPARENT_COLOR};
+    bool restarted = false;
+    frame->pixels = NULL;
+
+    for (;;) {
+        GifRecordType type = TERMINATE_RECORD_TYPE;
+        bool ok = decoder.gif && DGifGetRecordType(decoder.gif, &type) != GIF_ERROR;
+
+        if (ok && type == IMAGE_DESC_RECORD_TYPE) {
+            if (DGifGetImageDesc(decoder.gif) != GIF_ERROR && decode_image(&gc, frame))
+                return true;
+            free(frame->pixels);
+            frame->pixels = NULL;
+            ok = false;
+        } else if (ok && type == EXTENSION_RECORD_TYPE) {
+            /* Find the Graphics Control extension, which holds the delay */
+            int code;
+            GifByteType *ext;
+            ok = DGifGetExtension(decoder.gif, &code, &ext) != GIF_ERROR;
+            if (ok && code == GRAPHICS_EXT_FUNC_CODE && ext != NULL)
+                DGifExtensionToGCB(ext[0], ext + 1, &gc);
+            while (ok && ext != NULL)
+                ok = DGifGetExtensionNext(decoder.gif, &ext) != GIF_ERROR;
+            if (ok)
+                continue;
+        } else if (ok && type != TERMINATE_RECORD_TYPE) {
+            continue;
+        }
+
+        if (!ok)
+            DEBUG("Could not read GIF frame %d, (Error %d)\n", decoder.next_index, decoder.gif ? decoder.gif->Error : 0);
+
+        /* End of the file: loop back to the first frame, once */
+        if (restarted || decoder.next_index == 0)
+            return false;
+        restarted = true;
+        close_decoder();
+        if (!open_decoder())
+            return false;
+        gc = (GraphicsControlBlock){DISPOSAL_UNSPECIFIED, false, 0, NO_TRANSPARENT_COLOR};
+    }
+}
+
+/*
+ * Body of the worker thread: keeps GIF_DECODE_AHEAD frames decoded.
+ */
+static void *decode_ahead(void *arg) {
+    for (;;) {
+        pthread_mutex_lock(&queue_mutex);
+        while (queue_length == GIF_DECODE_AHEAD && !worker_stop)
+            pthread_cond_wait(&queue_cond, &queue_mutex);
+        const bool stop = worker_stop;
+        pthread_mutex_unlock(&queue_mutex);
+        if (stop)
+            break;
+
+        gif_frame_t frame;
+        if (!decode_next_frame(&frame)) {
+            pthread_mutex_lock(&queue_mutex);
+            worker_failed = true;
+            pthread_mutex_unlock(&queue_mutex);
+            break;
+        }
+
+        pthread_mutex_lock(&queue_mutex);
+        if (worker_stop) {
+            pthread_mutex_unlock(&queue_mutex);
+            free(frame.pixels);
+            break;
+        }
+        queue[(queue_head + queue_length) % GIF_DECODE_AHEAD] = frame;
+        queue_length++;
+        pthread_mutex_unlock(&queue_mutex);
+    }
+
+    DEBUG("GIF decoder stopped\n");
+    return NULL;
+}
+
+/*
+ * Takes the oldest decoded frame off the queue. Without a worker, the frame
+ * is decoded right here. Once no more frames can be decoded, the animation
+ * stops on the frame shown.
+ */
+static bool pop_frame(gif_frame_t *frame) {
+    pthread_mutex_lock(&queue_mutex);
+    bool found = queue_length > 0;
+    if (found) {
+        *frame = queue[queue_head];
+        queue_head = (queue_head + 1) % GIF_DECODE_AHEAD;
+        queue_length--;
+        pthread_cond_signal(&queue_cond);
+    }
+    const bool decode_here = !found && !worker_running;
+    bool failed = !found && worker_failed;
+    pthread_mutex_unlock(&queue_mutex);
+
+    if (decode_here) {
+        found = decode_next_frame(frame);
+        failed = !found;
+    }
+    if (failed) {
+        DEBUG("No more GIF frames, stopping the animation\n");
+        animated = false;
+    }
+    return found;
+}
+
+void gif_unload(void) {
+    if (worker_running) {
+        pthread_mutex_lock(&queue_mutex);
+        worker_stop = true;
+        pthread_cond_signal(&queue_cond);
+        pthread_mutex_unlock(&queue_mutex);
+        pthread_join(worker, NULL);
+        worker_running = false;
+        worker_stop = false;
+    }
+    worker_failed = false;
+
+    for (; queue_length > 0; queue_length--) {
+        free(queue[queue_head].pixels);
+        queue_head = (queue_head + 1) % GIF_DECODE_AHEAD;
+    }
+    queue_head = 0;
+    free(shown.pixels);
+    memset(&shown, 0, sizeof(shown));
+    free_decoder();
+
+    /* Redraws still showing a canvas hold their own reference to it */
+    for (int i = 0; i < 2; i++) {
+        if (canvases[i])
+            cairo_surface_destroy(canvases[i]);
+        canvases[i] = NULL;
+    }
+    front = 0;
+    animated = false;
+}
+
+cairo_surface_t *gif_load(image_file_t *file) {
+    gif_frame_t next = {0};
+
+    gif_unload();
+
+    /* The file is read for as long as the animation runs. A mapping could
+     * be truncated under us in the meantime (which raises SIGBUS), so the
+     * decoder reads from a copy of its own. */
+    if (file->mapped) {
+        decoder.file.data = malloc(file->size);
+        if (decoder.file.data == NULL) {
+            fprintf(stderr, "Could not allocate memory for the GIF file\n");
+            return NULL;
+        }
+        memcpy(decoder.file.data, file->data, file->size);
+        decoder.file.size = file->size;
+        image_file_close(file);
+    } else {
+        decoder.file = *file;
+    }
+    file->data = NULL;
+    if (!open_decoder())
+        goto gif_load_fail;
+
+    /* Load canvas properties */
+    uint32_t palette[256];
+    decoder.width = decoder.gif->SWidth;
+    decoder.height = decoder.gif->SHeight;
+    gif_palette(decoder.gif->SColorMap, palette);
+    decoder.bg_color = palette[decoder.gif->SBackGroundColor & 0xff];
+    if (decoder.width <= 0 || decoder.height <= 0) {
+        fprintf(stderr, "Invalid GIF canvas size %dx%d\n", decoder.width, decoder.height);
+        goto gif_load_fail;
+    }
+    decoder.disposed = (gif_rect_t){0, 0, decoder.width, decoder.height};
+
+    decoder.canvas = malloc((size_t)decoder.width * decoder.height * sizeof(uint32_t));
+    decoder.saved = malloc((size_t)decoder.width * decoder.height * sizeof(uint32_t));
+    if (!decoder.canvas || !decoder.saved) {
+        fprintf(stderr, "Could not allocate memory for GIF image buffers\n");
+        goto gif_load_fail;
+    }
+    gif_fill_rect(decoder.canvas, decoder.width, decoder.disposed, decoder.bg_color);
+
+    for (int i = 0; i < 2; i++) {
+        canvases[i] = cairo_image_surface_create(CAIRO_FORMAT_RGB24, decoder.width, decoder.height);
+        if (cairo_surface_status(canvases[i]) != CAIRO_STATUS_SUCCESS) {
+            fprintf(stderr, "Could not create surface: %s\n",
+                    cairo_status_to_string(cairo_surface_status(canvases[i])));
+            goto gif_load_fail;
+        }
+    }
+
+    /* Only the first frame is needed to show something */
+    if (!decode_next_frame(&shown)) {
+        fprintf(stderr, "Could not read the GIF image\n");
+        goto gif_load_fail;
+    }
+    for (int i = 0; i < 2; i++) {
+        cairo_surface_flush(canvases[i]);
+        apply_frame(canvases[i], &shown);
+        cairo_surface_mark_dirty(canvases[i]);
+    }
+    front = 0;
+
+    /* A still image needs neither the decoder nor the file any more */
+    if (decode_next_frame(&next) && next.index != 0) {
+        queue[0] = next;
+        queue_head = 0;
+        queue_length = 1;
+        animated = true;
+    } else {
+        free(next.pixels);
+        free_decoder();
+    }
+    DEBUG("Loaded %s GIF\n", animated ? "animated" : "still");
+    return canvases[0];
+
+gif_load_fail:
+    gif_unload();
+    return NULL;
+}
+
+void gif_start_decoder(void) {
+    if (!animated || worker_running)
+        return;
+
+    if (pthread_create(&worker, NULL, decode_ahead, NULL) == 0)
+        worker_running = true;
+}
+
+bool gif_animated(void) {
+    return animated;
+}
+
+double gif_frame_delay(void) {
+    return shown.delay;
+}
+
+cairo_surface_t *gif_next_frame(cairo_rectangle_int_t *damage) {
+    if (!animated)
+        return NULL;
+
+    const int back = !front;
+    cairo_surface_t *surface = canvases[back];
+
+    /* Only we hold a reference unless a redraw still uses it */
+    if (cairo_surface_get_reference_count(surface) > 1)
+        return NULL;
+
+    gif_frame_t next;
+    if (!pop_frame(&next))
+        return NULL;
+
+    /* The back canvas is one frame behind the front one, so it gets the
+     * frame it missed and the new one. */
+    cairo_surface_flush(surface);
+    apply_frame(surface, &shown);
+    apply_frame(surface, &next);
+    cairo_surface_mark_dirty(surface);
+
+    /* Each frame holds everything that changed since the previous one */
+    *damage = (cairo_rectangle_int_t){next.rect.left, next.rect.top,
+                                      next.rect.right - next.rect.left, next.rect.bottom - next.rect.top};
+
+    free(shown.pixels);
+    shown = next;
+    front = back;
+    return surface;
+}
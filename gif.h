@@ -0,0 +1,51 @@
+#ifndef _GIF_H
+#define _GIF_H
+
+#include <stdbool.h>
+#include <cairo.h>
+
+#include "image_file.h"
+
+/*
+ * Decodes the first frame of a GIF and returns a surface showing it, or NULL
+ * on error. Further frames are decoded as the animation advances, so this
+ * takes over file (file->data is set to NULL). The surface belongs to the
+ * animation and is drawn into as it advances, so callers must not destroy
+ * it. Unloads the GIF loaded before, if any.
+ */
+cairo_surface_t *gif_load(image_file_t *file);
+
+/*
+ * Stops the decoder thread and frees the loaded GIF, including the surfaces
+ * gif_load() and gif_next_frame() returned (their users need references of
+ * their own). Call this before loading another image.
+ */
+void gif_unload(void);
+
+/*
+ * Starts decoding the following frames ahead on a worker thread. Call this
+ * after forking. Without it, frames are decoded by gif_next_frame().
+ */
+void gif_start_decoder(void);
+
+/*
+ * Returns whether the loaded GIF has more than one frame, until a frame
+ * cannot be decoded and the animation stops.
+ */
+bool gif_animated(void);
+
+/*
+ * Returns how long the frame currently shown stays on screen, in seconds.
+ */
+double gif_frame_delay(void);
+
+/*
+ * Advances the animation by one frame and returns the surface showing it.
+ * Returns NULL (and stays on the current frame) while the next frame is not
+ * decoded yet, or while the surface it would be drawn into is still
+ * referenced by a redraw. damage is set to the part of the frame (in image
+ * pixels) that differs from the previous one.
+ */
+cairo_surface_t *gif_next_frame(cairo_rectangle_int_t *damage);
+
+#endif
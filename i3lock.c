@@ -58,11 +58,13 @@
 #include "randr.h"
 #include "dpi.h"
 #include "blur.h"
+#include "tinyexpr.h"
 #include "jpg.h"
+#include "image_file.h"
+#include "raw_convert.h"
+#include "gif.h"
 #include "fonts.h"
 
-#include <gif_lib.h>
-
 #define TSTAMP_N_SECS(n) (n * 1.0)
 #define TSTAMP_N_MINS(n) (60 * TSTAMP_N_SECS(n))
 #define START_TIMER(timer_obj, timeout, callback) \
@@ -72,6 +74,8 @@
 
 typedef void (*ev_callback_t)(EV_P_ ev_timer *w, int revents);
 static void input_done(void);
+static void redecode_jpeg_background(void);
+static void start_gif_animation(void);
 
 char color[9] = "a3a3a3ff";
 
@@ -205,6 +209,35 @@ char* greeter_text = "";
 bool blur = false;
 bool step_blur = false;
 int blur_sigma = 5;
+/* number of threads to blur with, 0 means one per CPU */
+int blur_threads = 0;
+/* smallest sigma kept when blurring at a lower resolution, 0 disables it */
+int blur_quality = 4;
+/* filter used for --blur */
+blur_mode_t blur_mode = BLUR_BOX;
+/* block size of the mosaic over the captured screen, 0 disables it */
+int pixelate = 0;
+/* --blur-region rectangles, as x, y, width and height expressions */
+#define MAX_BLUR_REGIONS 8
+static char blur_regions[MAX_BLUR_REGIONS][4][32];
+static int blur_region_count = 0;
+/* The captured screen while a worker blurs it. The lock window shows the
+ * plain background until it is swapped in as blur_bg_img. */
+static cairo_surface_t *pending_bg_img = NULL;
+/* What the blur worker works on: the surface plus its own copy of the screen
+ * layout, which handle_screen_resize() may replace in the meantime. */
+typedef struct {
+    cairo_surface_t *surface;
+    double scaling_factor;
+    int screen_count;
+    Rect *screens;
+    uint32_t resolution[2];
+} blur_job_t;
+static blur_job_t blur_job;
+static pthread_t blur_thread;
+static struct ev_async *blur_done_watcher = NULL;
+/* measure the blur kernels and exit, see blur_benchmark() */
+static bool blur_bench = false;
 
 /* do not verify password */
 bool no_verify = false;
@@ -246,17 +279,11 @@ static uint8_t xkb_base_error;
 static int randr_base = -1;
 
 char *image_path = NULL;
+/* --image-fd, read instead of image_path if set */
+static int image_fd = -1;
 char *image_raw_format = NULL;
 char *slideshow_path = NULL;
 
-struct gif {
-    cairo_surface_t *img;
-    float delay_sec;
-};
-
-struct gif *gif_img = NULL;
-int gif_img_count = 0;
-
 cairo_surface_t *img = NULL;
 char *img_slideshow[256];
 cairo_surface_t *blur_bg_img = NULL;
@@ -297,6 +324,9 @@ pthread_t draw_thread;
 // main thread still sometimes calls redraw()
 // allow you to disable. handy if you use bar with lots of crap.
 bool redraw_thread = false;
+// set once draw_thread is running. From then on, the main thread only
+// publishes snapshots of the lock state and the thread does all drawing.
+bool redraw_thread_running = false;
 
 // experimental bar stuff
 #define BAR_VERT 0
@@ -1097,59 +1127,41 @@ static void handle_screen_resize(void) {
 
     free(geom);
 
-    redraw_screen();
-
     uint32_t mask = XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT;
     xcb_configure_window(conn, win, mask, last_resolution);
     xcb_flush(conn);
 
     randr_query(screen->root);
+    redecode_jpeg_background();
+    /* Goes through a snapshot like every other redraw, so with
+     * --redraw-thread only the redraw thread draws. */
     redraw_screen();
 }
 
-static ssize_t read_raw_image_native(uint32_t *dest, FILE *src, size_t width, size_t height, int pixstride) {
-    ssize_t count = 0;
-    for (size_t y = 0; y < height; y++) {
-        size_t n = fread(&dest[y * pixstride], 1, width * 4, src);
+static size_t read_raw_image_native(uint32_t *dest, const unsigned char *src, size_t avail,
+                                    size_t width, size_t height, int pixstride) {
+    size_t count = 0;
+    for (size_t y = 0; y < height && count < avail; y++) {
+        size_t n = width * 4;
+        if (n > avail - count)
+            n = avail - count;
+        memcpy(&dest[y * pixstride], src + count, n);
         count += n;
-        if (n < (size_t)(width * 4))
-            break;
     }
 
     return count;
 }
 
-struct raw_pixel_format {
-    int bpp;
-    int red;
-    int green;
-    int blue;
-};
-
-static ssize_t read_raw_image_fmt(uint32_t *dest, FILE *src, size_t width, size_t height, int pixstride,
-                                  struct raw_pixel_format fmt) {
-    unsigned char *buf = malloc(width * fmt.bpp);
-    if (buf == NULL)
-        return -1;
-
-    ssize_t count = 0;
-    for (size_t y = 0; y < height; y++) {
-        size_t n = fread(buf, 1, width * fmt.bpp, src);
-        count += n;
-        if (n < (size_t)(width * fmt.bpp))
-            break;
-
-        for (size_t x = 0; x < width; ++x) {
-            int idx = x * fmt.bpp;
-            dest[y * pixstride + x] = 0 |
-                                      (buf[idx + fmt.red]) << 16 |
-                                      (buf[idx + fmt.green]) << 8 |
-                                      (buf[idx + fmt.blue]);
-        }
-    }
+static size_t read_raw_image_fmt(uint32_t *dest, const unsigned char *src, size_t avail,
+                                 size_t width, size_t height, int pixstride,
+                                 struct raw_pixel_format fmt) {
+    const size_t row_bytes = width * fmt.bpp;
+    if (row_bytes == 0)
+        return 0;
+    const size_t rows = avail / row_bytes < height ? avail / row_bytes : height;
+    raw_convert_rows(dest, pixstride, src, width, rows, &fmt);
 
-    free(buf);
-    return count;
+    return avail < height * row_bytes ? avail : height * row_bytes;
 }
 
 // Pre-defind pixel formats (<bytes per pixel>, <red pixel>, <green pixel>, <blue pixel>)
@@ -1160,132 +1172,24 @@ static const struct raw_pixel_format raw_fmt_bgr = {3, 2, 1, 0};
 static const struct raw_pixel_format raw_fmt_bgrx = {4, 2, 1, 0};
 static const struct raw_pixel_format raw_fmt_xbgr = {4, 3, 2, 1};
 
-static cairo_surface_t *read_gif_image(const char *image_path) {
-    int err;
-    int width, stride, height;
-    int bg_idx;
-    uint32_t bg_color;
-    ColorMapObject *cmap;
-    GraphicsControlBlock gc;
-
-    /* Open and load a GIF file */
-    GifFileType *gif = DGifOpenFileName(image_path, &err);
-    if (!gif) {
-        fprintf(stderr, "Could not open GIF file, (Error %d)\n", err);
-        return NULL;
-    }
-    if (DGifSlurp(gif) != GIF_OK) {
-        fprintf(stderr, "Could not read the GIF image, (Error %d)\n", gif->Error);
-        goto read_gif_image_clean;
-    }
-
-    /* Load canvas properties */
-    width = gif->SWidth;
-    height = gif->SHeight;
-    cmap = gif->SColorMap;
-    bg_idx = gif->SBackGroundColor;
-    GifColorType *cmap_bg_rgb = cmap->Colors + bg_idx;
-    bg_color = cmap_bg_rgb->Blue | cmap_bg_rgb->Green << 8 | cmap_bg_rgb->Red << 16;
-    stride = cairo_format_stride_for_width(CAIRO_FORMAT_RGB24, width) / sizeof(uint32_t);
-    if (stride < 0) {
-        fprintf(stderr, "Invalid distance between beginning of rows\n");
-        goto read_gif_image_clean;
-    }
-
-    /* Read the images into the RGB buffers */
-    gif_img = malloc(gif->ImageCount * sizeof(struct gif));
-    gif_img_count = gif->ImageCount;
-    if (!gif_img) {
-        fprintf(stderr, "Could not allocate memory for GIF image buffers\n");
-        goto read_gif_image_clean;
-    }
-    uint32_t *data_prev = NULL;
-    for (SavedImage *pimg = gif->SavedImages; pimg < gif->SavedImages + gif->ImageCount; ++pimg) {
-        int idx = pimg - gif->SavedImages;
-        /* Create image surface */
-        gif_img[idx].img = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
-        if (cairo_surface_status(gif_img[idx].img) != CAIRO_STATUS_SUCCESS) {
-            fprintf(stderr, "Could not create surface: %s\n",
-                    cairo_status_to_string(cairo_surface_status(gif_img[idx].img)));
-            free(gif_img);
-            gif_img = NULL;
-            goto read_gif_image_clean;
-        }
-        cairo_surface_flush(gif_img[idx].img);
-        uint32_t *data = (uint32_t *)cairo_image_surface_get_data(gif_img[idx].img);
-
-        // TODO: Check L,R,W,H && color map?
-        /* Find Graphics Control extension and delay */
-        for (int iext = 0; iext < pimg->ExtensionBlockCount; ++iext) {
-            ExtensionBlock *pext = pimg->ExtensionBlocks + iext;
-            switch (pext->Function) {
-                case GRAPHICS_EXT_FUNC_CODE:
-                    DGifExtensionToGCB(pext->ByteCount, pext->Bytes, &gc);
-                    // Delay time is in [ms]. Scale it to seconds.
-                    gif_img[idx].delay_sec = gc.DelayTime * 0.01;
-                    break;
-                default:
-                    gif_img[idx].delay_sec = 0;
-            }
-        }
-
-        /* Set general image attributes */
-        ColorMapObject *cmap_img = pimg->ImageDesc.ColorMap;
-        if (!cmap_img) cmap_img = cmap;
-        int img_left = pimg->ImageDesc.Left;
-        int img_width = pimg->ImageDesc.Width;
-        int img_right = img_left + img_width;
-        int img_top = pimg->ImageDesc.Top;
-        int img_bottom = img_top + pimg->ImageDesc.Height;
-
-        /* Handle disposal mode */
-        int data_size = width * height * ((int)sizeof(width));
-        switch (gc.DisposalMode) {
-            case DISPOSE_DO_NOT:
-                if (data_prev) {
-                    memcpy(data, data_prev, data_size);
-                } else {
-                    memset(data, 0, data_size);
-                }
-                break;
-            case DISPOSE_BACKGROUND:
-                memset(data, bg_color, data_size);
-                break;
-            default:
-                memset(data, 0, data_size);
-        }
-
-        /* Read RGB */
-        for (int x = 0; x < width; ++x) {
-            for (int y = 0; y < height; ++y) {
-                int color_idx;
-                if (x < img_left || x >= img_right || y < img_top || y >= img_bottom) {
-                    color_idx = bg_idx;
-                } else {
-                    color_idx = *(pimg->RasterBits + (x - img_left) + ((y - img_top) * img_width));
-                }
-
-                if (color_idx != gc.TransparentColor) {
-                    GifColorType *cmap_rgb = cmap_img->Colors + color_idx;
-                    uint32_t rgb = cmap_rgb->Blue | cmap_rgb->Green << 8 | cmap_rgb->Red << 16;
-                    data[x + (y*width)] = rgb;
-                }
-            }
-        }
-        data_prev = data;
+static cairo_status_t read_png_data(void *closure, unsigned char *data, unsigned int length) {
+    return image_reader_read(closure, data, length) == length ? CAIRO_STATUS_SUCCESS : CAIRO_STATUS_READ_ERROR;
+}
 
-        cairo_surface_mark_dirty(gif_img[idx].img);
-    }
+/* Ties the file buffer to a surface created directly on top of it. */
+static const cairo_user_data_key_t raw_image_file_key;
 
-read_gif_image_clean:
-    if (!DGifCloseFile(gif, &err)) {
-        DEBUG("DGifCloseFile call failed, (Error %d)\n", err);
-    }
-
-    return gif_img[0].img;
+static void free_raw_image_file(void *data) {
+    image_file_close(data);
+    free(data);
 }
 
-static cairo_surface_t *read_raw_image(const char *image_path, const char *image_raw_format) {
+/*
+ * Reads a --raw image. A complete native image read into a buffer (from a
+ * pipe, say) takes over file->data (which is then set to NULL) instead of
+ * copying it.
+ */
+static cairo_surface_t *read_raw_image(image_file_t *file, const char *image_raw_format) {
     cairo_surface_t *img;
 
 #define RAW_PIXFMT_MAXLEN 6
@@ -1303,6 +1207,26 @@ static cairo_surface_t *read_raw_image(const char *image_path, const char *image
 #undef STRINGIFY1
 #undef STRINGIFY
 
+    /* A complete native image already is in cairo's layout (RGB24 rows are
+     * never padded), so a buffer we own becomes the surface. Mapped files
+     * are always copied: the background lives as long as the lock, and
+     * anyone who can truncate the file in the meantime would crash the
+     * locker with SIGBUS. */
+    image_file_t *owned;
+    if (strcmp(pixfmt, "native") == 0 && !file->mapped && file->size >= w * h * 4 &&
+        cairo_format_stride_for_width(CAIRO_FORMAT_RGB24, w) == (int)(w * 4) &&
+        (owned = malloc(sizeof(image_file_t))) != NULL) {
+        *owned = *file;
+        img = cairo_image_surface_create_for_data(file->data, CAIRO_FORMAT_RGB24, w, h, w * 4);
+        if (cairo_surface_status(img) == CAIRO_STATUS_SUCCESS &&
+            cairo_surface_set_user_data(img, &raw_image_file_key, owned, free_raw_image_file) == CAIRO_STATUS_SUCCESS) {
+            file->data = NULL;
+            return img;
+        }
+        cairo_surface_destroy(img);
+        free(owned);
+    }
+
     /* Create image surface */
     img = cairo_image_surface_create(CAIRO_FORMAT_RGB24, w, h);
     if (cairo_surface_status(img) != CAIRO_STATUS_SUCCESS) {
@@ -1316,20 +1240,12 @@ static cairo_surface_t *read_raw_image(const char *image_path, const char *image
     uint32_t *data = (uint32_t *)cairo_image_surface_get_data(img);
     const int pixstride = cairo_image_surface_get_stride(img) / 4;
 
-    FILE *f = fopen(image_path, "rb");
-    if (f == NULL) {
-        fprintf(stderr, "Could not open image \"%s\": %s\n",
-                image_path, strerror(errno));
-        cairo_surface_destroy(img);
-        return NULL;
-    }
-
     /* Read the image, respecting cairo's stride, according to the pixfmt */
-    ssize_t size, count;
+    size_t size, count;
     if (strcmp(pixfmt, "native") == 0) {
-        /* If the pixfmt is 'native', just read each line directly into the buffer */
+        /* If the pixfmt is 'native', just copy each line directly into the buffer */
         size = w * h * 4;
-        count = read_raw_image_native(data, f, w, h, pixstride);
+        count = read_raw_image_native(data, file->data, file->size, w, h, pixstride);
     } else {
         const struct raw_pixel_format *fmt = NULL;
 
@@ -1348,33 +1264,22 @@ static cairo_surface_t *read_raw_image(const char *image_path, const char *image
 
         if (fmt == NULL) {
             fprintf(stderr, "Unknown raw pixel format: %s\n", pixfmt);
-            fclose(f);
             cairo_surface_destroy(img);
             return NULL;
         }
 
         size = w * h * fmt->bpp;
-        count = read_raw_image_fmt(data, f, w, h, pixstride, *fmt);
+        count = read_raw_image_fmt(data, file->data, file->size, w, h, pixstride, *fmt);
     }
 
     cairo_surface_mark_dirty(img);
 
     if (count < size) {
-        if (count < 0 || ferror(f)) {
-            fprintf(stderr, "Failed to read image \"%s\": %s\n",
-                    image_path, strerror(errno));
-            fclose(f);
-            cairo_surface_destroy(img);
-            return NULL;
-        } else {
-            /* Print a warning if the file contains less data than expected,
-             * but don't abort. It's useful to see how the image looks even if it's wrong. */
-            fprintf(stderr, "Warning: expected to read %zi bytes from \"%s\", read %zi\n",
-                    size, image_path, count);
-        }
+        /* Print a warning if the file contains less data than expected,
+         * but don't abort. It's useful to see how the image looks even if it's wrong. */
+        fprintf(stderr, "Warning: expected to read %zu bytes, read %zu\n", size, count);
     }
 
-    fclose(f);
     return img;
 }
 
@@ -1422,26 +1327,20 @@ static bool verify_gif_image(FILE *gif_file) {
     return false;
 }
 
-static enum IMAGE_FORMAT verify_image(const char *image_path) {
-    if (!image_path) {
-        return false;
-    }
-
+static enum IMAGE_FORMAT verify_image(const image_file_t *image) {
     if (image_raw_format != NULL) {
         return IMAGE_FORMAT_RAW;
     }
 
-    /* Check file exists and has correct header */
-    FILE *file = fopen(image_path, "rb");
+    /* Check the file has a known header */
+    FILE *file = image->size > 0 ? fmemopen(image->data, image->size, "rb") : NULL;
     if (file == NULL) {
-        fprintf(stderr, "Image file path \"%s\" cannot be opened (Error %s)\n", image_path, strerror(errno));
-        return false;
+        fprintf(stderr, "Image file is empty or cannot be read\n");
+        return IMAGE_FORMAT_UNKNOWN;
     }
 
     enum IMAGE_FORMAT format = IMAGE_FORMAT_UNKNOWN;
-    if (image_raw_format != NULL) {
-        format = IMAGE_FORMAT_RAW;
-    } else if (verify_png_image(file)) {
+    if (verify_png_image(file)) {
         format = IMAGE_FORMAT_PNG;
     } else if (file_is_jpg(file)) {
         format = IMAGE_FORMAT_JPG;
@@ -1648,37 +1547,154 @@ static void raise_loop(xcb_window_t window) {
 }
 
 /*
- * Loads an image from the given path. Handles JPEG and PNG. Returns NULL in case of error.
+ * Returns the largest factor by which draw_image() magnifies an image of the
+ * given size on any monitor, so that it can be decoded at a reduced size.
+ * Images which are not scaled (centered, tiled or without bg_type) return 0.
+ */
+static double image_display_scale(uint width, uint height) {
+    if (bg_type != FILL && bg_type != SCALE && bg_type != MAX)
+        return 0;
+
+    const Rect root = {0, 0, last_resolution[0], last_resolution[1]};
+    const int screens = xr_screens > 0 ? xr_screens : 1;
+    double max_scale = 0;
+    for (int s = 0; s < screens; s++) {
+        const Rect *rect = xr_screens > 0 ? &xr_resolutions[s] : &root;
+        double scale_x = (double) rect->width / width;
+        double scale_y = (double) rect->height / height;
+        /* SCALE stretches each axis on its own, FILL covers the screen with
+         * the larger factor, MAX fits inside it with the smaller one. */
+        double scale = bg_type == MAX ? fmin(scale_x, scale_y) : fmax(scale_x, scale_y);
+        if (scale > max_scale)
+            max_scale = scale;
+    }
+    return max_scale;
+}
+
+/* Frees the pixels of a decoded JPEG along with its surface. */
+static const cairo_user_data_key_t jpeg_data_key;
+
+/*
+ * A JPEG background decoded at a reduced size keeps a copy of its compressed
+ * data, so that it can be decoded again once an output needs more pixels
+ * than the layout at load time did.
+ */
+static struct {
+    void *data;
+    size_t size;
+    JPEG_INFO info;
+    /* the surface decoded from it, not a reference */
+    cairo_surface_t *surface;
+} jpeg_source;
+
+static void forget_jpeg_source(void) {
+    free(jpeg_source.data);
+    memset(&jpeg_source, 0, sizeof(jpeg_source));
+}
+
+/*
+ * Decodes the JPEG in file for the current screen layout. Returns NULL in
+ * case of error.
+ */
+static cairo_surface_t *decode_jpeg(const image_file_t *file, JPEG_INFO *info) {
+    unsigned char *data = read_JPEG_file(file, info, image_display_scale);
+    if (data == NULL)
+        return NULL;
+
+    cairo_surface_t *surface = cairo_image_surface_create_for_data(data, CAIRO_FORMAT_ARGB32,
+                                                                   info->width, info->height, info->stride);
+    if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS)
+        free(data);
+    else
+        cairo_surface_set_user_data(surface, &jpeg_data_key, data, free);
+    return surface;
+}
+
+/* Loads a JPEG, keeping its data if it was decoded at a reduced size. */
+static cairo_surface_t *load_jpeg(const image_file_t *file) {
+    JPEG_INFO info;
+    cairo_surface_t *surface = decode_jpeg(file, &info);
+    if (surface == NULL || cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS || info.scale_denom <= 1)
+        return surface;
+
+    if ((jpeg_source.data = malloc(file->size)) != NULL) {
+        memcpy(jpeg_source.data, file->data, file->size);
+        jpeg_source.size = file->size;
+        jpeg_source.info = info;
+        jpeg_source.surface = surface;
+    }
+    return surface;
+}
+
+/*
+ * Decodes the background JPEG again if the current screen layout magnifies
+ * it more than the one it was decoded for. Snapshots still drawing the old
+ * surface hold their own references to it.
+ */
+static void redecode_jpeg_background(void) {
+    if (jpeg_source.data == NULL || img != jpeg_source.surface)
+        return;
+    const JPEG_INFO *info = &jpeg_source.info;
+    if (image_display_scale(info->image_width, info->image_height) * info->scale_denom <= 1)
+        return;
+
+    DEBUG("screen layout changed, decoding the image at a larger size\n");
+    const image_file_t file = {jpeg_source.data, jpeg_source.size, false};
+    JPEG_INFO new_info;
+    cairo_surface_t *surface = decode_jpeg(&file, &new_info);
+    if (surface == NULL || cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+        if (surface)
+            cairo_surface_destroy(surface);
+        return;
+    }
+
+    cairo_surface_destroy(img);
+    img = surface;
+    if (new_info.scale_denom > 1) {
+        jpeg_source.info = new_info;
+        jpeg_source.surface = surface;
+    } else {
+        forget_jpeg_source();
+    }
+}
+
+/*
+ * Loads an image from the given path ("-" for stdin), or from --image-fd if
+ * path is NULL. Handles raw, PNG, JPEG and GIF. Returns NULL in case of error.
  */
-cairo_surface_t *load_image(enum IMAGE_FORMAT format) {
+cairo_surface_t *load_image(const char *path) {
     cairo_surface_t *img = NULL;
-    JPEG_INFO jpg_info;
-    unsigned char *jpg_data;
 
-    switch (format) {
+    /* the image this replaces is neither redecoded nor animated any more */
+    forget_jpeg_source();
+    gif_unload();
+
+    image_file_t file;
+    if (path == NULL ? !image_file_open_fd(image_fd, "from --image-fd", &file) : !image_file_open(path, &file))
+        return NULL;
+
+    image_reader_t reader = {&file, 0};
+    switch (verify_image(&file)) {
         case IMAGE_FORMAT_RAW:
             /* Read image. 'read_raw_image' returns NULL on error,
              * so we don't have to handle errors here. */
-            img = read_raw_image(image_path, image_raw_format);
+            img = read_raw_image(&file, image_raw_format);
             break;
         case IMAGE_FORMAT_PNG:
-            img = cairo_image_surface_create_from_png(image_path);
+            img = cairo_image_surface_create_from_png_stream(read_png_data, &reader);
             break;
         case IMAGE_FORMAT_JPG:
-            jpg_data = read_JPEG_file(image_path, &jpg_info);
-            if (jpg_data != NULL) {
-                img = cairo_image_surface_create_for_data(jpg_data,
-                                                          CAIRO_FORMAT_ARGB32, jpg_info.width, jpg_info.height,
-                                                          jpg_info.stride);
-            }
+            img = load_jpeg(&file);
             break;
         case IMAGE_FORMAT_GIF:
-            img = read_gif_image(image_path);
+            img = gif_load(&file);
             break;
         default:
-            fprintf(stderr, "Unsupported image file format: %s\n", image_path);
+            fprintf(stderr, "Unsupported image file format: %s\n", path ? path : "from --image-fd");
     }
 
+    image_file_close(&file);
+
     /* In case loading failed, we just pretend no -i was specified. */
     if (img && cairo_surface_status(img) != CAIRO_STATUS_SUCCESS) {
         fprintf(stderr, "Could not load image, %s\n",
@@ -1686,6 +1702,11 @@ cairo_surface_t *load_image(enum IMAGE_FORMAT format) {
         img = NULL;
     }
 
+    /* Animates GIFs the slideshow loads. Images loaded before main() set up
+     * the event loop are animated from there. */
+    if (img)
+        start_gif_animation();
+
     return img;
 }
 
@@ -1738,15 +1759,216 @@ bool load_slideshow_images(const char *path) {
     return true;
 }
 
-void gif_anim_loop(struct ev_loop *loop, struct ev_timer *timer, int delay) {
-    static int img_count = 0;
+/*
+ * Blurs the --blur-region rectangles of every screen of the job. The
+ * expressions use the same variables (and units) as --indpos: the screen's w,
+ * h, x and y.
+ */
+static void blur_screen_regions(const blur_job_t *job) {
+    const double scaling_factor = job->scaling_factor;
+    double width = 0, height = 0, screen_x = 0, screen_y = 0;
+    te_variable vars[] = {{"w", &width}, {"h", &height}, {"x", &screen_x}, {"y", &screen_y}};
+    te_expr *exprs[MAX_BLUR_REGIONS][4];
+
+    for (int i = 0; i < blur_region_count; i++) {
+        for (int j = 0; j < 4; j++) {
+            int te_err = 0;
+            exprs[i][j] = te_compile(blur_regions[i][j], vars, 4, &te_err);
+            if (te_err)
+                errx(EXIT_FAILURE, "Failed to reason about '%s' given by '--blur-region'", blur_regions[i][j]);
+        }
+    }
+
+    const int screens = job->screen_count > 0 ? job->screen_count : 1;
+    for (int s = 0; s < screens; s++) {
+        if (job->screen_count > 0) {
+            width = job->screens[s].width / scaling_factor;
+            height = job->screens[s].height / scaling_factor;
+            screen_x = job->screens[s].x / scaling_factor;
+            screen_y = job->screens[s].y / scaling_factor;
+        } else {
+            width = job->resolution[0] / scaling_factor;
+            height = job->resolution[1] / scaling_factor;
+        }
+
+        for (int i = 0; i < blur_region_count; i++) {
+            cairo_rectangle_int_t rect = {
+                lround(te_eval(exprs[i][0]) * scaling_factor),
+                lround(te_eval(exprs[i][1]) * scaling_factor),
+                lround(te_eval(exprs[i][2]) * scaling_factor),
+                lround(te_eval(exprs[i][3]) * scaling_factor)};
+            DEBUG("blurring region %d,%d %dx%d of screen %d\n", rect.x, rect.y, rect.width, rect.height, s);
+            blur_image_region(job->surface, &rect, blur_sigma);
+        }
+    }
+
+    for (int i = 0; i < blur_region_count; i++)
+        for (int j = 0; j < 4; j++)
+            te_free(exprs[i][j]);
+}
+
+/* Applies --blur, --blur-region and --pixelate to the captured screen. */
+static void obfuscate_background(const blur_job_t *job) {
+    if (blur && blur_region_count > 0)
+        blur_screen_regions(job);
+    else if (blur)
+        blur_image_surface(job->surface, blur_sigma);
+    if (pixelate > 1)
+        pixelate_image_surface(job->surface, pixelate);
+}
+
+static void *blur_background_thread(void *arg) {
+    obfuscate_background(arg);
+    ev_async_send(main_loop, blur_done_watcher);
+    return NULL;
+}
 
-    if (++img_count >= gif_img_count) img_count = 0;
-    img = gif_img[img_count].img;
-    ev_timer_stop(loop, timer);
+/*
+ * Makes the blurred screen the background. Snapshots that are still being
+ * drawn hold their own reference to the old background (if any), so dropping
+ * ours here does not pull it from under the redraw thread.
+ */
+static void swap_in_blurred_background(void) {
+    if (blur_bg_img)
+        cairo_surface_destroy(blur_bg_img);
+    blur_bg_img = pending_bg_img;
+    pending_bg_img = NULL;
+    free(blur_job.screens);
+    memset(&blur_job, 0, sizeof(blur_job));
     redraw_screen();
-    ev_timer_set(timer, gif_img[img_count].delay_sec, 0.);
-    ev_timer_start(loop, timer);
+}
+
+static void blur_done_cb(EV_P_ ev_async *w, int revents) {
+    pthread_join(blur_thread, NULL);
+    ev_async_stop(main_loop, w);
+    DEBUG("background blurred, swapping it in\n");
+    swap_in_blurred_background();
+}
+
+/*
+ * Blurs the captured screen on a worker thread, so that the screen is locked
+ * (and input grabbed) without waiting for it. Falls back to blurring right
+ * away if the thread cannot be started.
+ */
+static void start_background_blur(void) {
+    blur_job.surface = pending_bg_img;
+    blur_job.scaling_factor = get_dpi_value() / 96.0;
+    blur_job.resolution[0] = last_resolution[0];
+    blur_job.resolution[1] = last_resolution[1];
+    if (xr_screens > 0 && (blur_job.screens = malloc(xr_screens * sizeof(Rect))) != NULL) {
+        memcpy(blur_job.screens, xr_resolutions, xr_screens * sizeof(Rect));
+        blur_job.screen_count = xr_screens;
+    }
+
+    blur_done_watcher = calloc(sizeof(struct ev_async), 1);
+    if (blur_done_watcher) {
+        ev_async_init(blur_done_watcher, blur_done_cb);
+        ev_async_start(main_loop, blur_done_watcher);
+        if (pthread_create(&blur_thread, NULL, blur_background_thread, &blur_job) == 0)
+            return;
+        ev_async_stop(main_loop, blur_done_watcher);
+    }
+
+    obfuscate_background(&blur_job);
+    swap_in_blurred_background();
+}
+
+/* If the animation falls further behind than this (e.g. after a suspend),
+ * it continues from the current frame instead of catching up. */
+#define GIF_MAX_LAG 1.0
+/* How soon to check again when the next frame is not decoded yet */
+#define GIF_RETRY_DELAY 0.01
+
+/* When the next GIF frame is due, in ev_now() time like the clock tick */
+static ev_tstamp next_frame_at;
+static struct ev_periodic *gif_timer;
+
+static void damage_union(cairo_rectangle_int_t *dst, const cairo_rectangle_int_t *src) {
+    const int x1 = dst->x + dst->width > src->x + src->width ? dst->x + dst->width : src->x + src->width;
+    const int y1 = dst->y + dst->height > src->y + src->height ? dst->y + dst->height : src->y + src->height;
+    dst->x = dst->x < src->x ? dst->x : src->x;
+    dst->y = dst->y < src->y ? dst->y : src->y;
+    dst->width = x1 - dst->x;
+    dst->height = y1 - dst->y;
+}
+
+/*
+ * Starts the animation over from now if it fell too far behind, or if the
+ * clock was set back and the next frame would otherwise stay up far longer
+ * than its delay.
+ */
+static void gif_restart_if_off(ev_tstamp now) {
+    if (now - next_frame_at > GIF_MAX_LAG || next_frame_at - now > gif_frame_delay() + GIF_MAX_LAG)
+        next_frame_at = now;
+}
+
+/*
+ * Tells libev when gif_anim_cb() is due. libev asks again whenever the clock
+ * jumps, which a fixed absolute time would not follow.
+ */
+static ev_tstamp gif_reschedule_cb(ev_periodic *w, ev_tstamp now) {
+    gif_restart_if_off(now);
+    return fmax(next_frame_at, now + GIF_RETRY_DELAY);
+}
+
+/*
+ * Shows the GIF frame that is due and schedules the next one. Frames are due
+ * at absolute times, so rendering does not delay the animation. Frames whose
+ * time already passed are skipped instead of being drawn late.
+ */
+static void gif_anim_cb(struct ev_loop *loop, ev_periodic *w, int revents) {
+    /* The slideshow replaced the GIF, or it ran out of frames */
+    if (!gif_animated()) {
+        ev_periodic_stop(loop, w);
+        return;
+    }
+
+    const ev_tstamp now = ev_now(loop);
+    gif_restart_if_off(now);
+
+    cairo_rectangle_int_t damage, frame_damage;
+    cairo_surface_t *frame = NULL;
+    int frames = 0;
+    while (next_frame_at <= now) {
+        /* If the next frame cannot be drawn yet, show the current one longer */
+        cairo_surface_t *next = gif_next_frame(&frame_damage);
+        if (!next)
+            break;
+        if (frames++ == 0)
+            damage = frame_damage;
+        else
+            damage_union(&damage, &frame_damage);
+        img = frame = next;
+        next_frame_at += gif_frame_delay();
+    }
+
+    if (frames > 1)
+        DEBUG("gif: skipped %d late frames\n", frames - 1);
+    if (frames > 0)
+        redraw_image_region(frame, &damage);
+
+    /* picks up the new next_frame_at, see gif_reschedule_cb() */
+    ev_periodic_again(loop, w);
+}
+
+/*
+ * Starts animating the GIF just loaded, if it has several frames. This only
+ * happens once the main loop is set up, which is after forking, so the
+ * decoder thread runs in the process that stays around.
+ */
+static void start_gif_animation(void) {
+    if (main_loop == NULL || !gif_animated())
+        return;
+
+    if (gif_timer == NULL) {
+        if (!(gif_timer = calloc(sizeof(struct ev_periodic), 1)))
+            return;
+        ev_periodic_init(gif_timer, gif_anim_cb, 0., 0., gif_reschedule_cb);
+    }
+    gif_start_decoder();
+    next_frame_at = ev_now(main_loop) + gif_frame_delay();
+    /* (re)starts the timer, see gif_reschedule_cb() */
+    ev_periodic_again(main_loop, gif_timer);
 }
 
 int main(int argc, char *argv[]) {
@@ -1921,6 +2143,13 @@ int main(int argc, char *argv[]) {
         {"refresh-rate", required_argument, NULL, 901},
         {"composite", no_argument, NULL, 902},
         {"no-verify", no_argument, NULL, 905},
+        {"blur-threads", required_argument, NULL, 906},
+        {"blur-quality", required_argument, NULL, 907},
+        {"blur-bench", no_argument, NULL, 908},
+        {"blur-mode", required_argument, NULL, 909},
+        {"pixelate", required_argument, NULL, 910},
+        {"blur-region", required_argument, NULL, 911},
+        {"image-fd", required_argument, NULL, 912},
 
         // slideshow options
         {"slideshow-interval", required_argument, NULL, 903},
@@ -2608,6 +2837,74 @@ int main(int argc, char *argv[]) {
             case 905:
                 no_verify = true;
                 break;
+            case 906:
+                blur_threads = atoi(optarg);
+                if (blur_threads < 0) {
+                    blur_threads = 0;
+                }
+                break;
+            case 907:
+                blur_quality = atoi(optarg);
+                if (blur_quality < 0) {
+                    blur_quality = 0;
+                }
+                break;
+            case 908:
+                blur_bench = true;
+                break;
+            case 909:
+                if (!strcmp(optarg, "box")) {
+                    blur_mode = BLUR_BOX;
+                } else if (!strcmp(optarg, "gaussian")) {
+                    blur_mode = BLUR_GAUSSIAN;
+                } else if (!strcmp(optarg, "dual-kawase")) {
+                    blur_mode = BLUR_DUAL_KAWASE;
+                } else {
+                    errx(EXIT_FAILURE, "i3lock: Invalid blur mode given. Expected one of \"box\", \"gaussian\" or \"dual-kawase\".");
+                }
+                break;
+            case 910:
+                pixelate = atoi(optarg);
+                if (pixelate < 0) {
+                    pixelate = 0;
+                } else if (pixelate > 1024) {
+                    pixelate = 1024;
+                }
+                break;
+            case 911:
+                if (blur_region_count >= MAX_BLUR_REGIONS) {
+                    errx(1, "at most %d blur regions can be given\n", MAX_BLUR_REGIONS);
+                }
+                if (strlen(optarg) > 4 * 31 + 3) {
+                    errx(1, "blur region string can be at most %d characters\n", 4 * 31 + 3);
+                }
+                if (sscanf(optarg, "%31[^:]:%31[^:]:%31[^:]:%31[^:]",
+                           blur_regions[blur_region_count][0], blur_regions[blur_region_count][1],
+                           blur_regions[blur_region_count][2], blur_regions[blur_region_count][3]) != 4) {
+                    errx(1, "blur-region must be of the form x:y:w:h\n");
+                }
+                /* The regions are evaluated on the blur thread once the
+                 * screen is locked, where failing is no option. Check them
+                 * now. */
+                for (int j = 0; j < 4; j++) {
+                    double unused = 0;
+                    te_variable vars[] = {{"w", &unused}, {"h", &unused}, {"x", &unused}, {"y", &unused}};
+                    int te_err = 0;
+                    te_expr *expr = te_compile(blur_regions[blur_region_count][j], vars, 4, &te_err);
+                    if (te_err)
+                        errx(EXIT_FAILURE, "Failed to reason about '%s' given by '--blur-region'", blur_regions[blur_region_count][j]);
+                    te_free(expr);
+                }
+                blur_region_count++;
+                break;
+            case 912: {
+                struct stat fd_stat;
+                image_fd = atoi(optarg);
+                if (image_fd < 0 || fstat(image_fd, &fd_stat) != 0) {
+                    errx(EXIT_FAILURE, "i3lock-color: --image-fd %s is not an open file descriptor", optarg);
+                }
+                break;
+            }
             case 998:
                 image_raw_format = strdup(optarg);
                 break;
@@ -2621,6 +2918,12 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    /* Runs after parsing so that --blur-threads and --blur-quality apply. */
+    if (blur_bench) {
+        blur_benchmark();
+        exit(EXIT_SUCCESS);
+    }
+
     /* We need (relatively) random numbers for highlighting a random part of
      * the unlock indicator upon keypresses. */
     srand(time(NULL));
@@ -2733,31 +3036,33 @@ int main(int argc, char *argv[]) {
                                  (uint32_t[]){XCB_EVENT_MASK_STRUCTURE_NOTIFY});
 
     init_colors_once();
-    if (image_path != NULL) {
-        if (!is_directory(image_path)) {
-            enum IMAGE_FORMAT image_format = verify_image(image_path);
-            img = load_image(image_format);
+    if (image_fd >= 0) {
+        img = load_image(NULL);
+        close(image_fd);
+    } else if (image_path != NULL) {
+        if (strcmp(image_path, "-") == 0 || !is_directory(image_path)) {
+            img = load_image(image_path);
         } else {
             /* Path to a directory is provided -> use slideshow mode */
             slideshow_path = strdup(image_path);
             if (!load_slideshow_images(slideshow_path)) exit(EXIT_FAILURE);
-            enum IMAGE_FORMAT image_format = verify_image(img_slideshow[0]);
-            img = load_image(image_format);
+            img = load_image(img_slideshow[0]);
         }
         free(image_path);
     }
     free(image_raw_format);
 
-    if (blur) {
+    if (blur || pixelate > 1) {
         xcb_pixmap_t bg_pixmap = capture_bg_pixmap(conn, screen, last_resolution);
         cairo_surface_t *xcb_img = cairo_xcb_surface_create(conn, bg_pixmap, get_root_visual_type(screen), last_resolution[0], last_resolution[1]);
 
-        blur_bg_img = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, last_resolution[0], last_resolution[1]);
-        cairo_t *ctx = cairo_create(blur_bg_img);
+        /* Only read the screen back here. It is blurred once the screen is
+         * locked, see start_background_blur(). */
+        pending_bg_img = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, last_resolution[0], last_resolution[1]);
+        cairo_t *ctx = cairo_create(pending_bg_img);
 
         cairo_set_source_surface(ctx, xcb_img, 0, 0);
         cairo_paint(ctx);
-        blur_image_surface(blur_bg_img, blur_sigma);
 
         cairo_destroy(ctx);
         cairo_surface_destroy(xcb_img);
@@ -2826,7 +3131,6 @@ int main(int argc, char *argv[]) {
     struct ev_io *xcb_watcher = calloc(sizeof(struct ev_io), 1);
     struct ev_check *xcb_check = calloc(sizeof(struct ev_check), 1);
     struct ev_prepare *xcb_prepare = calloc(sizeof(struct ev_prepare), 1);
-    struct ev_timer *xcb_timer = calloc(sizeof(struct ev_timer), 1);
 
     ev_io_init(xcb_watcher, xcb_got_event, xcb_get_file_descriptor(conn), EV_READ);
     ev_io_start(main_loop, xcb_watcher);
@@ -2837,10 +3141,11 @@ int main(int argc, char *argv[]) {
     ev_prepare_init(xcb_prepare, xcb_prepare_cb);
     ev_prepare_start(main_loop, xcb_prepare);
 
-    if (gif_img) {
-        ev_timer_init(xcb_timer, gif_anim_loop, gif_img[0].delay_sec, 0.);
-        ev_timer_start(main_loop, xcb_timer);
-    }
+    if (pending_bg_img)
+        start_background_blur();
+
+    if (img)
+        start_gif_animation();
 
     /* Invoke the event callback once to catch all the events which were
      * received up until now. ev will only pick up new events (when the X11
@@ -2849,15 +3154,20 @@ int main(int argc, char *argv[]) {
 
     if (show_clock || bar_enabled || slideshow_enabled) {
         if (redraw_thread) {
-            struct timespec ts;
+            static struct timespec ts;
             double s;
             double ns = modf(refresh_rate, &s);
             ts.tv_sec = (time_t) s;
             ts.tv_nsec = ns * NANOSECONDS_IN_SECOND;
-            (void) pthread_create(&draw_thread, NULL, start_time_redraw_tick_pthread, (void*) &ts);
-        } else {
-            start_time_redraw_tick(main_loop);
+            if (pthread_create(&draw_thread, NULL, start_time_redraw_tick_pthread, (void*) &ts) == 0) {
+                redraw_thread_running = true;
+                redraw_screen();
+            }
         }
+        /* With the redraw thread, this tick publishes a snapshot the thread
+         * renders; the thread only renders on its own when none arrives
+         * shortly after a tick, i.e. while the main loop is blocked. */
+        start_time_redraw_tick(main_loop);
     }
     ev_loop(main_loop, 0);
 
@@ -0,0 +1,112 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * image_file.c: maps image files into memory, so that decoders can read
+ *               them without copying them through stdio first.
+ *
+ * See LICENSE for licensing information
+ *
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "image_file.h"
+
+/*
+ * Reads everything up to EOF into a malloc()ed buffer.
+ */
+static bool read_whole_file(int fd, image_file_t *file) {
+    size_t capacity = 1 << 20;
+    size_t size = 0;
+    unsigned char *data = malloc(capacity);
+    if (data == NULL)
+        return false;
+
+    for (;;) {
+        if (size == capacity) {
+            unsigned char *grown = realloc(data, capacity * 2);
+            if (grown == NULL) {
+                free(data);
+                return false;
+            }
+            data = grown;
+            capacity *= 2;
+        }
+
+        ssize_t n = read(fd, data + size, capacity - size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            free(data);
+            return false;
+        }
+        if (n == 0)
+            break;
+        size += n;
+    }
+
+    file->data = data;
+    file->size = size;
+    file->mapped = false;
+    return true;
+}
+
+bool image_file_open_fd(int fd, const char *name, image_file_t *file) {
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            file->data = data;
+            file->size = st.st_size;
+            file->mapped = true;
+            return true;
+        }
+    }
+
+    if (!read_whole_file(fd, file)) {
+        fprintf(stderr, "Could not read image file %s: %s\n", name, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool image_file_open(const char *path, image_file_t *file) {
+    if (strcmp(path, "-") == 0)
+        return image_file_open_fd(STDIN_FILENO, "from stdin", file);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open image file %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    bool ok = image_file_open_fd(fd, path, file);
+    close(fd);
+    return ok;
+}
+
+void image_file_close(image_file_t *file) {
+    if (file->data == NULL)
+        return;
+    if (file->mapped)
+        munmap(file->data, file->size);
+    else
+        free(file->data);
+    file->data = NULL;
+    file->size = 0;
+}
+
+size_t image_reader_read(image_reader_t *reader, void *buf, size_t len) {
+    size_t left = reader->file->size - reader->pos;
+    if (len > left)
+        len = left;
+    memcpy(buf, (const unsigned char *)reader->file->data + reader->pos, len);
+    reader->pos += len;
+    return len;
+}
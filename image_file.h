@@ -0,0 +1,51 @@
+#ifndef _IMAGE_FILE_H
+#define _IMAGE_FILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * The contents of an image file, either mapped into memory or, for files
+ * which cannot be mapped (pipes, character devices), read into a buffer.
+ */
+typedef struct {
+    void *data;
+    size_t size;
+    bool mapped;
+} image_file_t;
+
+/*
+ * Maps the given file copy-on-write (MAP_PRIVATE, so that writes to the
+ * memory never reach the file). A path of "-" reads stdin. Returns false and
+ * prints an error on failure.
+ *
+ * Only keep a mapping for as long as it takes to decode it: reading it after
+ * someone truncated the file raises SIGBUS.
+ */
+bool image_file_open(const char *path, image_file_t *file);
+
+/*
+ * Like image_file_open(), but for an already open descriptor, e.g. a pipe or
+ * a memfd handed over by a screenshot tool. Regular files and memfds are
+ * mapped from their start, anything else is read from its current position
+ * up to EOF. The descriptor is left open.
+ */
+bool image_file_open_fd(int fd, const char *name, image_file_t *file);
+
+/*
+ * Unmaps or frees the file contents.
+ */
+void image_file_close(image_file_t *file);
+
+/* Reads an image_file_t front to back, for decoders which pull their input. */
+typedef struct {
+    const image_file_t *file;
+    size_t pos;
+} image_reader_t;
+
+/*
+ * Copies up to len bytes into buf and returns how many there were.
+ */
+size_t image_reader_read(image_reader_t *reader, void *buf, size_t len);
+
+#endif
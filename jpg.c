@@ -31,27 +31,39 @@ bool file_is_jpg(FILE* image_file) {
 }
 
 /*
- * Reads a JPEG from a file into memory, in a format that Cairo can create a
- * surface from.
+ * Picks the libjpeg scale denominator: the largest of 8, 4 and 2 at which the
+ * image still covers what it is drawn on. libjpeg scales in the DCT domain,
+ * so this also skips most of the IDCT work, not just the memory.
  */
-void* read_JPEG_file(char *file_path, JPEG_INFO *jpg_info) {
-    int img_err;
+static unsigned int jpeg_scale_denom(uint width, uint height, jpeg_scale_fn display_scale) {
+    if (display_scale == NULL)
+        return 1;
+
+    double scale = display_scale(width, height);
+    if (scale <= 0)
+        return 1;
+
+    unsigned int denom = 8;
+    while (denom > 1 && denom * scale > 1)
+        denom /= 2;
+    return denom;
+}
+
+/*
+ * Decodes a JPEG file into memory, in a format that Cairo can create a
+ * surface from. If display_scale is given, the image is decoded at the
+ * smallest power-of-two fraction of its size (down to 1/8) that is still not
+ * magnified when drawn.
+ */
+void* read_JPEG_file(const image_file_t *file, JPEG_INFO *jpg_info, jpeg_scale_fn display_scale) {
     struct jpeg_decompress_struct cinfo;
     struct jpeg_error_mgr jerr;
-    FILE *infile;                 /* source file */
     void *img;                    /* decompressed image data pointer */
 
-    if ((infile = fopen(file_path, "rb")) == NULL) {
-        img_err = errno;
-        fprintf(stderr, "Could not open image file %s: %s\n",
-                file_path, strerror(img_err));
-        return NULL;
-    }
-
     cinfo.err = jpeg_std_error(&jerr);
     jpeg_create_decompress(&cinfo);
 
-    jpeg_stdio_src(&cinfo, infile);
+    jpeg_mem_src(&cinfo, file->data, file->size);
 
     (void) jpeg_read_header(&cinfo, TRUE);
 
@@ -59,10 +71,16 @@ void* read_JPEG_file(char *file_path, JPEG_INFO *jpg_info) {
     // TODO: Test this code on non-x86_64 platforms
     cinfo.out_color_space = JCS_EXT_BGRA;
 
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = jpeg_scale_denom(cinfo.image_width, cinfo.image_height, display_scale);
+
     (void) jpeg_start_decompress(&cinfo);
 
     jpg_info->height = cinfo.output_height;
     jpg_info->width = cinfo.output_width;
+    jpg_info->image_width = cinfo.image_width;
+    jpg_info->image_height = cinfo.image_height;
+    jpg_info->scale_denom = cinfo.scale_denom;
 
     /* Get the *cairo* stride rather than the stride from the image. This is
      * the space needed in memory for each row for optimized Cairo rendering. */
@@ -86,7 +104,6 @@ void* read_JPEG_file(char *file_path, JPEG_INFO *jpg_info) {
 
         (void) jpeg_finish_decompress(&cinfo);
         jpeg_destroy_decompress(&cinfo);
-        fclose(infile);
 
         return NULL;
     }
@@ -102,7 +119,6 @@ void* read_JPEG_file(char *file_path, JPEG_INFO *jpg_info) {
     (void) jpeg_finish_decompress(&cinfo);
 
     jpeg_destroy_decompress(&cinfo);
-    fclose(infile);
 
     return img;
 }
@@ -3,11 +3,16 @@
 
 #include <sys/types.h>
 
+#include "image_file.h"
+
 #define _GNU_SOURCE 1
 typedef struct {
     uint height;
     uint width;
     uint stride; // The width of each row in memory, in bytes
+    uint image_width; // The size of the image in the file
+    uint image_height;
+    uint scale_denom; // It was decoded at 1/scale_denom of that size
 } JPEG_INFO;
 
 /*
@@ -16,9 +21,17 @@ typedef struct {
 bool file_is_jpg(FILE* image_file);
 
 /*
- * Reads a JPEG from a file into memory, in a format that Cairo can create a
- * surface from.
+ * Returns the largest factor by which an image of the given size will be
+ * magnified when it is drawn, or 0 if it is drawn at its own size anyway.
+ */
+typedef double (*jpeg_scale_fn)(uint width, uint height);
+
+/*
+ * Decodes a JPEG file into memory, in a format that Cairo can create a
+ * surface from. If display_scale is given, the image is decoded at the
+ * smallest power-of-two fraction of its size (down to 1/8) that is still not
+ * magnified when drawn.
  */
-void* read_JPEG_file(char *filename, JPEG_INFO *jpg_info);
+void* read_JPEG_file(const image_file_t *file, JPEG_INFO *jpg_info, jpeg_scale_fn display_scale);
 
 #endif
@@ -0,0 +1,160 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * parallel.c: a tiny pool of worker threads, used to spread independent
+ *             pieces of rendering and blurring over all CPUs.
+ *
+ * See LICENSE for licensing information
+ *
+ */
+#include <stdbool.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "parallel.h"
+
+/* Protects the job list and the worker bookkeeping. */
+static pthread_mutex_t job_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+/* One parallel_for() call, living on its caller's stack. */
+typedef struct job {
+    parallel_fn_t fn;
+    void *arg;
+    int count;
+    int next;
+    int done;
+    /* number of workers (besides the caller) allowed to take items, and
+     * how many of them currently run one */
+    int max_helpers;
+    int helpers;
+    struct job *next_job;
+} job_t;
+
+/*
+ * The jobs of all running parallel_for() calls, newest first: several
+ * threads may use the pool at once, and a short job like redrawing the
+ * screen should not queue behind a long blur started earlier.
+ */
+static job_t *jobs = NULL;
+
+static int worker_count = 0;
+static bool atfork_registered = false;
+
+/* Set on pool threads, so that nested parallel_for() calls run serially
+ * instead of waiting for themselves. */
+static __thread bool in_worker = false;
+
+int parallel_cpu_count(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus < 1 ? 1 : (int)cpus;
+}
+
+/*
+ * Runs one item of the given job, on behalf of its caller or as one of its
+ * helpers. Must be called with job_mutex held, which is released while the
+ * item runs. The job may be gone once its last item is done.
+ */
+static void run_job_item(job_t *job, bool helper) {
+    int index = job->next++;
+    if (helper)
+        job->helpers++;
+    pthread_mutex_unlock(&job_mutex);
+    job->fn(job->arg, index);
+    pthread_mutex_lock(&job_mutex);
+    if (helper)
+        job->helpers--;
+    if (++job->done == job->count)
+        pthread_cond_broadcast(&done_cond);
+}
+
+/* Returns the newest job a worker can help with, or NULL. */
+static job_t *find_job(void) {
+    for (job_t *job = jobs; job; job = job->next_job)
+        if (job->next < job->count && job->helpers < job->max_helpers)
+            return job;
+    return NULL;
+}
+
+static void *worker_main(void *data) {
+    in_worker = true;
+    pthread_mutex_lock(&job_mutex);
+    while (true) {
+        job_t *job = find_job();
+        if (!job) {
+            pthread_cond_wait(&job_cond, &job_mutex);
+            continue;
+        }
+        // one item at a time, so that newer jobs get help right away
+        run_job_item(job, true);
+    }
+    return NULL;
+}
+
+/*
+ * Threads do not survive fork(), and i3lock forks after mapping its window.
+ * Start from an empty pool in the child.
+ */
+static void reset_pool_after_fork(void) {
+    pthread_mutex_init(&job_mutex, NULL);
+    pthread_cond_init(&job_cond, NULL);
+    pthread_cond_init(&done_cond, NULL);
+    worker_count = 0;
+    jobs = NULL;
+}
+
+/*
+ * Makes sure at least wanted workers are running. Must be called with
+ * job_mutex held. Returns the number of workers available.
+ */
+static int spawn_workers(int wanted) {
+    if (!atfork_registered) {
+        pthread_atfork(NULL, NULL, reset_pool_after_fork);
+        atfork_registered = true;
+    }
+
+    while (worker_count < wanted) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, worker_main, NULL) != 0)
+            break;
+        pthread_detach(thread);
+        worker_count++;
+    }
+    return worker_count;
+}
+
+void parallel_for(int count, int max_threads, parallel_fn_t fn, void *arg) {
+    if (max_threads <= 0)
+        max_threads = parallel_cpu_count();
+    if (max_threads > count)
+        max_threads = count;
+
+    if (max_threads <= 1 || in_worker) {
+        for (int i = 0; i < count; i++)
+            fn(arg, i);
+        return;
+    }
+
+    job_t job = {.fn = fn, .arg = arg, .count = count};
+
+    pthread_mutex_lock(&job_mutex);
+    job.max_helpers = spawn_workers(max_threads - 1);
+    if (job.max_helpers > max_threads - 1)
+        job.max_helpers = max_threads - 1;
+    job.next_job = jobs;
+    jobs = &job;
+    pthread_cond_broadcast(&job_cond);
+
+    while (job.next < job.count)
+        run_job_item(&job, false);
+    while (job.done < job.count)
+        pthread_cond_wait(&done_cond, &job_mutex);
+
+    job_t **link = &jobs;
+    while (*link != &job)
+        link = &(*link)->next_job;
+    *link = job.next_job;
+    pthread_mutex_unlock(&job_mutex);
+}
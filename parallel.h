@@ -0,0 +1,20 @@
+#ifndef _PARALLEL_H
+#define _PARALLEL_H
+
+typedef void (*parallel_fn_t)(void *arg, int index);
+
+/*
+ * Returns the number of online CPUs (at least 1).
+ */
+int parallel_cpu_count(void);
+
+/*
+ * Calls fn(arg, i) for every i in [0, count) and returns once all calls are
+ * done. The calls are spread over at most max_threads threads, the calling
+ * thread included; max_threads <= 0 means one thread per online CPU.
+ * Nested calls from inside fn run serially. Several threads may call it at
+ * once; the pool helps the most recent call first.
+ */
+void parallel_for(int count, int max_threads, parallel_fn_t fn, void *arg);
+
+#endif
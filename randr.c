@@ -32,6 +32,36 @@ extern bool debug_mode;
 
 void _xinerama_init(void);
 
+static bool rect_equal(const Rect *a, const Rect *b) {
+    return a->x == b->x && a->y == b->y &&
+           a->width == b->width && a->height == b->height;
+}
+
+/*
+ * Removes mirrored screens from the given list: a screen identical to an
+ * earlier one would get the same indicator drawn twice, so only the first
+ * one is kept. Smaller outputs inside a bigger one (e.g. a laptop panel
+ * mirroring a projector) are kept, as they show a different part of the
+ * picture. The order of the remaining screens is kept. Returns the new
+ * number of screens.
+ */
+static int canonicalize_screens(Rect *resolutions, int screens) {
+    int kept = 0;
+    for (int i = 0; i < screens; i++) {
+        bool duplicate = false;
+        for (int j = 0; j < kept && !duplicate; j++)
+            duplicate = rect_equal(&resolutions[j], &resolutions[i]);
+        if (duplicate) {
+            DEBUG("screen %d x %d at %d x %d is mirrored, skipping\n",
+                  resolutions[i].width, resolutions[i].height,
+                  resolutions[i].x, resolutions[i].y);
+            continue;
+        }
+        resolutions[kept++] = resolutions[i];
+    }
+    return kept;
+}
+
 void randr_init(int *event_base, xcb_window_t root) {
     const xcb_query_extension_reply_t *extreply;
 
@@ -147,7 +177,7 @@ static bool _randr_query_monitors_15(xcb_window_t root) {
     }
     free(xr_resolutions);
     xr_resolutions = resolutions;
-    xr_screens = screens;
+    xr_screens = canonicalize_screens(resolutions, screens);
 
     free(monitors);
     return true;
@@ -237,7 +267,7 @@ static bool _randr_query_outputs_14(xcb_window_t root) {
     }
     free(xr_resolutions);
     xr_resolutions = resolutions;
-    xr_screens = screen;
+    xr_screens = canonicalize_screens(resolutions, screen);
     free(res);
     return true;
 }
@@ -268,7 +298,7 @@ void _xinerama_query_screens(void) {
         return;
     }
 
-    for (int screen = 0; screen < xr_screens; screen++) {
+    for (int screen = 0; screen < screens; screen++) {
         resolutions[screen].x = screen_info[screen].x_org;
         resolutions[screen].y = screen_info[screen].y_org;
         resolutions[screen].width = screen_info[screen].width;
@@ -280,7 +310,7 @@ void _xinerama_query_screens(void) {
 
     free(xr_resolutions);
     xr_resolutions = resolutions;
-    xr_screens = screens;
+    xr_screens = canonicalize_screens(resolutions, screens);
 
     free(reply);
 }
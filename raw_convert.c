@@ -0,0 +1,121 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * raw_convert.c: converts packed raw pixels (--raw) into cairo's native
+ *                RGB24 layout.
+ *
+ * See LICENSE for licensing information
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "raw_convert.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RAW_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
+static void convert_row_generic(uint32_t *dst, const unsigned char *src, int width,
+                                const struct raw_pixel_format *fmt) {
+    for (int x = 0; x < width; ++x) {
+        const unsigned char *pixel = src + x * fmt->bpp;
+        dst[x] = 0 |
+                 (pixel[fmt->red]) << 16 |
+                 (pixel[fmt->green]) << 8 |
+                 (pixel[fmt->blue]);
+    }
+}
+
+#ifdef RAW_X86_DISPATCH
+/*
+ * Builds the pshufb control which turns 4 packed pixels into 4 little endian
+ * RGB24 pixels (B, G, R, 0). 0x80 selects a zero byte.
+ */
+static void shuffle_control(const struct raw_pixel_format *fmt, unsigned char control[16]) {
+    for (int i = 0; i < 4; i++) {
+        control[4 * i + 0] = i * fmt->bpp + fmt->blue;
+        control[4 * i + 1] = i * fmt->bpp + fmt->green;
+        control[4 * i + 2] = i * fmt->bpp + fmt->red;
+        control[4 * i + 3] = 0x80;
+    }
+}
+
+/*
+ * Returns how many leading pixels of a row are converted in blocks of step
+ * pixels. Each block loads 16 bytes at every 4th pixel, which reads past
+ * packed 3 byte pixels, so a block is only used if all its loads stay
+ * within the row.
+ */
+static inline int shuffled_pixels(int width, int bpp, int step) {
+    const int last_start = width * bpp - 16 - (step - 4) * bpp;
+    if (last_start < 0)
+        return 0;
+    return (last_start / (step * bpp) + 1) * step;
+}
+
+__attribute__((target("ssse3")))
+static void convert_row_ssse3(uint32_t *dst, const unsigned char *src, int width,
+                              const struct raw_pixel_format *fmt) {
+    unsigned char control[16];
+    shuffle_control(fmt, control);
+    const __m128i shuffle = _mm_loadu_si128((const __m128i *)control);
+    const int bpp = fmt->bpp;
+    const int end = shuffled_pixels(width, bpp, 4);
+
+    int x = 0;
+    for (; x < end; x += 4) {
+        __m128i in = _mm_loadu_si128((const __m128i *)(src + x * bpp));
+        _mm_storeu_si128((__m128i *)(dst + x), _mm_shuffle_epi8(in, shuffle));
+    }
+    convert_row_generic(dst + x, src + x * bpp, width - x, fmt);
+}
+
+__attribute__((target("avx2")))
+static void convert_row_avx2(uint32_t *dst, const unsigned char *src, int width,
+                             const struct raw_pixel_format *fmt) {
+    unsigned char control[16];
+    shuffle_control(fmt, control);
+    /* vpshufb works within 128 bit lanes, so each lane gets 4 pixels */
+    const __m256i shuffle = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)control));
+    const int bpp = fmt->bpp;
+    const int end = shuffled_pixels(width, bpp, 8);
+
+    int x = 0;
+    for (; x < end; x += 8) {
+        const unsigned char *in = src + x * bpp;
+        __m256i pixels = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)in)),
+            _mm_loadu_si128((const __m128i *)(in + 4 * bpp)), 1);
+        _mm256_storeu_si256((__m256i *)(dst + x), _mm256_shuffle_epi8(pixels, shuffle));
+    }
+    convert_row_ssse3(dst + x, src + x * bpp, width - x, fmt);
+}
+#endif
+
+typedef void (*convert_row_fn)(uint32_t *dst, const unsigned char *src, int width,
+                               const struct raw_pixel_format *fmt);
+
+/* Picks the widest shuffle kernel the CPU supports. */
+static convert_row_fn select_convert_row(const struct raw_pixel_format *fmt) {
+#ifdef RAW_X86_DISPATCH
+    const bool shuffles = (fmt->bpp == 3 || fmt->bpp == 4) &&
+                          fmt->red < fmt->bpp && fmt->green < fmt->bpp && fmt->blue < fmt->bpp;
+    if (shuffles) {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return convert_row_avx2;
+        if (__builtin_cpu_supports("ssse3"))
+            return convert_row_ssse3;
+    }
+#endif
+    return convert_row_generic;
+}
+
+void raw_convert_rows(uint32_t *dst, int dst_stride, const unsigned char *src, int width, int rows,
+                      const struct raw_pixel_format *fmt) {
+    const convert_row_fn convert_row = select_convert_row(fmt);
+    for (int y = 0; y < rows; y++)
+        convert_row(dst + (size_t)y * dst_stride, src + (size_t)y * width * fmt->bpp, width, fmt);
+}
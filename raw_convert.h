@@ -0,0 +1,23 @@
+#ifndef _RAW_CONVERT_H
+#define _RAW_CONVERT_H
+
+#include <stdint.h>
+
+/* The layout of a packed raw pixel: its size and the offset of each channel. */
+struct raw_pixel_format {
+    int bpp;
+    int red;
+    int green;
+    int blue;
+};
+
+/*
+ * Converts rows of width tightly packed pixels at src into cairo RGB24 pixels
+ * at dst, whose rows are dst_stride pixels apart. Layouts with 3 or 4 bytes
+ * per pixel are converted with byte shuffles (SSSE3 or AVX2, picked at
+ * runtime), everything else pixel by pixel.
+ */
+void raw_convert_rows(uint32_t *dst, int dst_stride, const unsigned char *src, int width, int rows,
+                      const struct raw_pixel_format *fmt);
+
+#endif
@@ -0,0 +1,330 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * text_cache.c: caches shaped strings and pre-rasterized glyphs, so that
+ *               redrawing text like the clock only blits pixels, even
+ *               when the string changed.
+ *
+ * See LICENSE for licensing information
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "text_cache.h"
+
+/* Strings change (clock ticks, status), so keep only the recent ones. */
+#define LAYOUT_CACHE_SIZE 32
+
+/* Rasterized glyphs, looked up by a hash of their key in sets of a few
+ * entries, the least recently used of which is replaced on a miss */
+#define GLYPH_CACHE_SETS 256
+#define GLYPH_CACHE_WAYS 4
+
+/* Text origins are rounded to this fraction of a device pixel */
+#define SUBPIXEL_STEPS 4
+
+/* Identifies a scaled font: face, font size and device scale. */
+typedef struct {
+    cairo_font_face_t *face;
+    double size;
+    double scale_x, scale_y;
+} font_key_t;
+
+typedef struct {
+    font_key_t font;
+    char *str;
+    text_layout_t layout;
+    unsigned long last_use;
+} layout_entry_t;
+
+/* One layer of a glyph: its fill, or its outline of a given width. */
+typedef struct {
+    font_key_t font;
+    unsigned long index;
+    /* 0 for the fill layer */
+    double outline_width;
+    /* where the glyph origin is within a device pixel, in 1/SUBPIXEL_STEPS */
+    int phase_x, phase_y;
+} glyph_key_t;
+
+typedef struct {
+    glyph_key_t key;
+    bool used;
+    /* alpha mask, NULL for glyphs without any ink, like spaces */
+    cairo_surface_t *mask;
+    /* offset of the mask's top left corner from the origin's pixel */
+    int left, top;
+    unsigned long last_use;
+} glyph_entry_t;
+
+/* A layer of a glyph as placed by text_cache_draw(), in device pixels. */
+typedef struct {
+    cairo_surface_t *mask;
+    double x, y;
+} placed_mask_t;
+
+/* Screens may be rendered concurrently, so all of the cache is locked. */
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static layout_entry_t layouts[LAYOUT_CACHE_SIZE];
+static unsigned long layout_clock = 0;
+
+static glyph_entry_t glyphs[GLYPH_CACHE_SETS][GLYPH_CACHE_WAYS];
+static unsigned long glyph_clock = 0;
+
+static font_key_t make_font_key(cairo_t *ctx, cairo_font_face_t *face, double size) {
+    cairo_matrix_t ctm;
+    cairo_get_matrix(ctx, &ctm);
+    font_key_t key = {face, size, ctm.xx, ctm.yy};
+    return key;
+}
+
+static bool font_key_equal(const font_key_t *a, const font_key_t *b) {
+    return a->face == b->face && a->size == b->size &&
+           a->scale_x == b->scale_x && a->scale_y == b->scale_y;
+}
+
+static cairo_scaled_font_t *create_scaled_font(const font_key_t *key) {
+    cairo_matrix_t fm, ctm;
+    cairo_matrix_init_scale(&fm, key->size, key->size);
+    cairo_matrix_init_scale(&ctm, key->scale_x, key->scale_y);
+    cairo_font_options_t *opts = cairo_font_options_create();
+    cairo_scaled_font_t *sft = cairo_scaled_font_create(key->face, &fm, &ctm, opts);
+    cairo_font_options_destroy(opts);
+    return sft;
+}
+
+static void copy_layout(text_layout_t *dest, const text_layout_t *src) {
+    dest->extents = src->extents;
+    dest->num_glyphs = src->num_glyphs;
+    dest->glyphs = malloc(src->num_glyphs * sizeof(cairo_glyph_t));
+    if (!dest->glyphs) {
+        dest->num_glyphs = 0;
+        return;
+    }
+    memcpy(dest->glyphs, src->glyphs, src->num_glyphs * sizeof(cairo_glyph_t));
+}
+
+bool text_cache_layout(cairo_t *ctx, cairo_font_face_t *face, double size, const char *str,
+                       text_layout_fn_t build, text_layout_t *layout) {
+    if (!face)
+        return false;
+
+    font_key_t key = make_font_key(ctx, face, size);
+
+    pthread_mutex_lock(&cache_mutex);
+    layout_entry_t *entry = NULL;
+    layout_entry_t *oldest = &layouts[0];
+    for (int i = 0; i < LAYOUT_CACHE_SIZE; i++) {
+        if (layouts[i].str && font_key_equal(&layouts[i].font, &key) &&
+            strcmp(layouts[i].str, str) == 0) {
+            entry = &layouts[i];
+            break;
+        }
+        if (layouts[i].last_use < oldest->last_use)
+            oldest = &layouts[i];
+    }
+
+    if (!entry) {
+        entry = oldest;
+        free(entry->str);
+        free(entry->layout.glyphs);
+        memset(entry, 0, sizeof(layout_entry_t));
+
+        cairo_scaled_font_t *sft = create_scaled_font(&key);
+        build(sft, str, size, &entry->layout);
+        cairo_scaled_font_destroy(sft);
+        entry->font = key;
+        entry->str = strdup(str);
+    }
+
+    entry->last_use = ++layout_clock;
+    copy_layout(layout, &entry->layout);
+    pthread_mutex_unlock(&cache_mutex);
+    return true;
+}
+
+void text_layout_free(text_layout_t *layout) {
+    free(layout->glyphs);
+    layout->glyphs = NULL;
+    layout->num_glyphs = 0;
+}
+
+/*
+ * Splits a device coordinate into a whole pixel and the subpixel phase.
+ */
+static void split_subpixel(double v, double *pixel, int *phase) {
+    *pixel = floor(v);
+    *phase = lround((v - *pixel) * SUBPIXEL_STEPS);
+    if (*phase == SUBPIXEL_STEPS) {
+        *pixel += 1;
+        *phase = 0;
+    }
+}
+
+static bool glyph_key_equal(const glyph_key_t *a, const glyph_key_t *b) {
+    return a->index == b->index && a->phase_x == b->phase_x && a->phase_y == b->phase_y &&
+           a->outline_width == b->outline_width && font_key_equal(&a->font, &b->font);
+}
+
+static uint32_t hash_bytes(uint32_t hash, const void *data, size_t length) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ bytes[i]) * 16777619u;
+    return hash;
+}
+
+/* FNV-1a over the fields of the key (not the padding between them). */
+static uint32_t hash_glyph_key(const glyph_key_t *key) {
+    uint32_t hash = 2166136261u;
+    hash = hash_bytes(hash, &key->font.face, sizeof(key->font.face));
+    hash = hash_bytes(hash, &key->font.size, sizeof(key->font.size));
+    hash = hash_bytes(hash, &key->font.scale_x, sizeof(key->font.scale_x));
+    hash = hash_bytes(hash, &key->font.scale_y, sizeof(key->font.scale_y));
+    hash = hash_bytes(hash, &key->index, sizeof(key->index));
+    hash = hash_bytes(hash, &key->outline_width, sizeof(key->outline_width));
+    hash = hash_bytes(hash, &key->phase_x, sizeof(key->phase_x));
+    hash = hash_bytes(hash, &key->phase_y, sizeof(key->phase_y));
+    return hash;
+}
+
+/*
+ * Renders one layer of a glyph into an alpha mask, in device pixels, with
+ * the origin at (phase_x, phase_y) / SUBPIXEL_STEPS within a pixel.
+ */
+static void rasterize_glyph(glyph_entry_t *entry) {
+    const glyph_key_t *key = &entry->key;
+    cairo_glyph_t glyph = {key->index, 0, 0};
+    cairo_scaled_font_t *sft = create_scaled_font(&key->font);
+    cairo_text_extents_t extents;
+    cairo_scaled_font_glyph_extents(sft, &glyph, 1, &extents);
+
+    if (extents.width <= 0 || extents.height <= 0) {
+        cairo_scaled_font_destroy(sft);
+        return;
+    }
+
+    /* leave room for the outline, for antialiasing and for the phase */
+    const double pad = key->outline_width / 2 + 1;
+    const double sx = key->font.scale_x, sy = key->font.scale_y;
+    const double px = (double)key->phase_x / SUBPIXEL_STEPS, py = (double)key->phase_y / SUBPIXEL_STEPS;
+    int left = floor((extents.x_bearing - pad) * sx + px);
+    int top = floor((extents.y_bearing - pad) * sy + py);
+    int right = ceil((extents.x_bearing + extents.width + pad) * sx + px);
+    int bottom = ceil((extents.y_bearing + extents.height + pad) * sy + py);
+
+    cairo_surface_t *mask = cairo_image_surface_create(CAIRO_FORMAT_A8, right - left, bottom - top);
+    cairo_t *ctx = cairo_create(mask);
+    cairo_translate(ctx, px - left, py - top);
+    cairo_scale(ctx, sx, sy);
+    cairo_set_scaled_font(ctx, sft);
+
+    cairo_glyph_path(ctx, &glyph, 1);
+    if (key->outline_width > 0) {
+        cairo_set_line_width(ctx, key->outline_width);
+        cairo_stroke(ctx);
+    } else {
+        cairo_fill(ctx);
+    }
+
+    cairo_destroy(ctx);
+    cairo_scaled_font_destroy(sft);
+
+    entry->mask = mask;
+    entry->left = left;
+    entry->top = top;
+}
+
+/*
+ * Looks up one layer of the glyph whose origin is at device position (x, y),
+ * rasterizing it on a miss. Must be called with cache_mutex held. Returns a
+ * reference to the mask and where to put it, or a NULL mask if there is
+ * nothing to draw.
+ */
+static placed_mask_t lookup_glyph(const font_key_t *font, unsigned long index, double outline_width,
+                                  double x, double y) {
+    glyph_key_t key = {*font, index, outline_width, 0, 0};
+    double pixel_x, pixel_y;
+    split_subpixel(x, &pixel_x, &key.phase_x);
+    split_subpixel(y, &pixel_y, &key.phase_y);
+
+    glyph_entry_t *set = glyphs[hash_glyph_key(&key) % GLYPH_CACHE_SETS];
+    glyph_entry_t *entry = NULL;
+    glyph_entry_t *oldest = &set[0];
+    for (int i = 0; i < GLYPH_CACHE_WAYS; i++) {
+        if (set[i].used && glyph_key_equal(&set[i].key, &key)) {
+            entry = &set[i];
+            break;
+        }
+        if (set[i].last_use < oldest->last_use)
+            oldest = &set[i];
+    }
+
+    if (!entry) {
+        entry = oldest;
+        if (entry->mask)
+            cairo_surface_destroy(entry->mask);
+        memset(entry, 0, sizeof(glyph_entry_t));
+        entry->key = key;
+        entry->used = true;
+        rasterize_glyph(entry);
+    }
+
+    entry->last_use = ++glyph_clock;
+    placed_mask_t placed = {NULL, pixel_x + entry->left, pixel_y + entry->top};
+    if (entry->mask)
+        placed.mask = cairo_surface_reference(entry->mask);
+    return placed;
+}
+
+/* Paints color through the placed masks and drops their references. */
+static void paint_masks(cairo_t *ctx, placed_mask_t *masks, int count, const rgba_t *color) {
+    cairo_set_source_rgba(ctx, color->red, color->green, color->blue, color->alpha);
+    for (int i = 0; i < count; i++) {
+        if (!masks[i].mask)
+            continue;
+        cairo_mask_surface(ctx, masks[i].mask, masks[i].x, masks[i].y);
+        cairo_surface_destroy(masks[i].mask);
+    }
+}
+
+void text_cache_draw(cairo_t *ctx, cairo_font_face_t *face, double size, const text_layout_t *layout,
+                     double x, double y, rgba_t color, rgba_t outline_color, double outline_width) {
+    if (!face || layout->num_glyphs == 0)
+        return;
+
+    const int count = layout->num_glyphs;
+    const bool outlined = outline_width > 0;
+    placed_mask_t *masks = malloc((outlined ? 2 : 1) * count * sizeof(placed_mask_t));
+    if (!masks)
+        return;
+
+    font_key_t key = make_font_key(ctx, face, size);
+    cairo_matrix_t ctm;
+    cairo_get_matrix(ctx, &ctm);
+
+    pthread_mutex_lock(&cache_mutex);
+    for (int i = 0; i < count; i++) {
+        double dx = x + layout->glyphs[i].x, dy = y + layout->glyphs[i].y;
+        cairo_matrix_transform_point(&ctm, &dx, &dy);
+        masks[i] = lookup_glyph(&key, layout->glyphs[i].index, 0, dx, dy);
+        if (outlined)
+            masks[count + i] = lookup_glyph(&key, layout->glyphs[i].index, outline_width, dx, dy);
+    }
+    pthread_mutex_unlock(&cache_mutex);
+
+    /* Drawing happens without holding the lock. All fills come first, then
+     * all outlines, like filling and stroking the string as one path. */
+    cairo_save(ctx);
+    cairo_identity_matrix(ctx);
+    paint_masks(ctx, masks, count, &color);
+    if (outlined)
+        paint_masks(ctx, masks + count, count, &outline_color);
+    cairo_restore(ctx);
+    free(masks);
+}
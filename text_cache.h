@@ -0,0 +1,44 @@
+#ifndef _TEXT_CACHE_H
+#define _TEXT_CACHE_H
+
+#include <stdbool.h>
+#include <cairo.h>
+
+#include "rgba.h"
+
+/*
+ * A shaped string: glyph positions relative to the text origin, plus the
+ * extents of the whole string used for alignment.
+ */
+typedef struct {
+    cairo_glyph_t *glyphs;
+    int num_glyphs;
+    cairo_text_extents_t extents;
+} text_layout_t;
+
+/*
+ * Shapes str with the given scaled font into layout. layout->glyphs must be
+ * allocated with malloc().
+ */
+typedef void (*text_layout_fn_t)(cairo_scaled_font_t *sft, const char *str, double size, text_layout_t *layout);
+
+/*
+ * Returns the layout of str in the given font face and size at the device
+ * scale of ctx. The string is only shaped (using build) when it is not in the
+ * cache yet. The returned copy must be freed with text_layout_free().
+ */
+bool text_cache_layout(cairo_t *ctx, cairo_font_face_t *face, double size, const char *str,
+                       text_layout_fn_t build, text_layout_t *layout);
+
+void text_layout_free(text_layout_t *layout);
+
+/*
+ * Draws the given layout at x, y (user space of ctx), filled with color and
+ * outlined with outline_color: all fills first, then all outlines. Each glyph
+ * is rasterized once per font/size, quarter-pixel position and outline width
+ * and then just blitted, so a new string only costs its new glyphs.
+ */
+void text_cache_draw(cairo_t *ctx, cairo_font_face_t *face, double size, const text_layout_t *layout,
+                     double x, double y, rgba_t color, rgba_t outline_color, double outline_width);
+
+#endif
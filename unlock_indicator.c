@@ -13,6 +13,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+#include <errno.h>
+#include <pthread.h>
 #include <xcb/xcb.h>
 #include <xcb/randr.h>
 #include <ev.h>
@@ -22,6 +24,8 @@
 #include "i3lock.h"
 #include "xcb.h"
 #include "unlock_indicator.h"
+#include "parallel.h"
+#include "text_cache.h"
 #include "randr.h"
 #include "dpi.h"
 #include "tinyexpr.h"
@@ -165,7 +169,11 @@ extern char *layout_text;
 extern char *greeter_text;
 
 bool load_slideshow_images(const char *path);
-cairo_surface_t* load_image(char* image_path);
+cairo_surface_t* load_image(const char* image_path);
+
+/* Set once the redraw thread runs, redraw_screen() then only publishes
+ * snapshots for it. */
+extern bool redraw_thread_running;
 
 /* Whether the failed attempts should be displayed. */
 extern bool show_failed_attempts;
@@ -196,6 +204,13 @@ int current_slideshow_index = 0;
 unlock_state_t unlock_state;
 auth_state_t auth_state;
 
+/* The latest snapshot published for the redraw thread, protected by
+ * snapshot_mutex. */
+static pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t snapshot_cond = PTHREAD_COND_INITIALIZER;
+static draw_snapshot_t pending_snapshot;
+static bool snapshot_pending = false;
+
 // color arrays
 rgba_t insidever16;
 rgba_t insidewrong16;
@@ -264,7 +279,9 @@ static control_char_config_t control_characters[] = {
 };
 size_t control_char_count = sizeof control_characters / sizeof(control_char_config_t);
 
-static cairo_font_face_t *get_font_face(int which) {
+static pthread_mutex_t font_faces_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static cairo_font_face_t *load_font_face(int which) {
     if (font_faces[which]) {
         return font_faces[which];
     }
@@ -323,59 +340,73 @@ static cairo_font_face_t *get_font_face(int which) {
 }
 
 /*
- * Splits the given text by "control chars",
- * And then draws the given text onto the cairo context.
+ * Returns the (cached) font face for the given font slot. Screens may be
+ * rendered concurrently, so the lazy loading is serialized.
  */
-static void draw_text_with_cc(cairo_t *ctx, text_t text, double start_x) {
-    // get scaled_font
-    cairo_scaled_font_t *sft;
-    cairo_matrix_t fm, ctm;
-    cairo_matrix_init_scale(&fm, text.size, text.size);
-    cairo_get_matrix(ctx, &ctm);
-    cairo_font_options_t *opts;
-    opts = cairo_font_options_create();
-    sft = cairo_scaled_font_create(text.font, &fm, &ctm, opts);
-    cairo_font_options_destroy(opts);
+static cairo_font_face_t *get_font_face(int which) {
+    pthread_mutex_lock(&font_faces_mutex);
+    cairo_font_face_t *face = load_font_face(which);
+    pthread_mutex_unlock(&font_faces_mutex);
+    return face;
+}
+
+/*
+ * Splits the given text by "control chars" and shapes it into glyphs,
+ * positioned relative to the text origin. Used to fill the layout cache.
+ */
+static void layout_text_with_cc(cairo_scaled_font_t *sft, const char *str, double size, text_layout_t *layout) {
     /* use `a` to represent common character width, using in `\t`  */
     cairo_text_extents_t te;
-    cairo_text_extents(ctx, "a", &te);
+    cairo_scaled_font_text_extents(sft, "a", &te);
+    cairo_scaled_font_text_extents(sft, str, &layout->extents);
+
+    layout->glyphs = NULL;
+    layout->num_glyphs = 0;
 
     // convert text to glyphs.
-    cairo_status_t status;
-    cairo_glyph_t* glyphs;
-    int nglyphs = 0,
-        len = 0,
-        start = 0,
-        lineno = 0,
-        x = start_x,
-        y = text.y;
+    cairo_glyph_t *glyphs;
+    int nglyphs,
+        lineno = 0;
+    double x = 0,
+           y = 0;
     size_t cur_cc;
 
-    while (text.str[start + len] != '\0') {
-        char is_cc = 0;
-        do {
+    while (*str != '\0') {
+        size_t len = 0;
+        cur_cc = control_char_count;
+        for (; str[len] != '\0'; len++) {
             for (cur_cc = 0; cur_cc < control_char_count; cur_cc++) {
-                if (text.str[start+len] == control_characters[cur_cc].character) {
-                    is_cc = 1;
+                if (str[len] == control_characters[cur_cc].character)
                     break;
-                }
             }
-        } while (text.str[start+(len++)] != '\0' && !is_cc);
-        if (len > is_cc) {
-            status = cairo_scaled_font_text_to_glyphs(
-                sft, x, y, text.str + start, is_cc ? len - 1: len,
+            if (cur_cc < control_char_count)
+                break;
+        }
+
+        glyphs = NULL;
+        nglyphs = 0;
+        if (len > 0) {
+            cairo_status_t status = cairo_scaled_font_text_to_glyphs(
+                sft, x, y, str, len,
                 &glyphs, &nglyphs,
                 NULL, NULL, NULL
             );
             if (status == CAIRO_STATUS_SUCCESS) {
-                cairo_glyph_path(ctx, glyphs, nglyphs);
+                cairo_glyph_t *all = realloc(layout->glyphs, (layout->num_glyphs + nglyphs) * sizeof(cairo_glyph_t));
+                if (all) {
+                    memcpy(all + layout->num_glyphs, glyphs, nglyphs * sizeof(cairo_glyph_t));
+                    layout->glyphs = all;
+                    layout->num_glyphs += nglyphs;
+                }
             } else {
-                DEBUG("draw %c failed\n", text.str[start]);
+                DEBUG("draw %c failed\n", str[0]);
+                glyphs = NULL;
+                nglyphs = 0;
             }
         }
-        if (is_cc && (cur_cc < control_char_count)) {
+        if (cur_cc < control_char_count) {
             if (control_characters[cur_cc].x_behavior == CC_POS_CHANGE) {
-                char x_offset = control_characters[cur_cc].x_behavior_arg;
+                int x_offset = control_characters[cur_cc].x_behavior_arg;
                 if (x_offset < 0 && x_offset > -nglyphs) {
                     x = glyphs[nglyphs+x_offset].x;
                 } else if (x_offset > 0) {
@@ -386,7 +417,7 @@ static void draw_text_with_cc(cairo_t *ctx, text_t text, double start_x) {
                     }
                 }
             } else if (control_characters[cur_cc].x_behavior == CC_POS_RESET) {
-                x = start_x;
+                x = 0;
             } else if (control_characters[cur_cc].x_behavior == CC_POS_TAB) {
                 if (nglyphs > 0) { // there may be leading tab, such as '\t\t' or '\n\t'
                     int advance = control_characters[cur_cc].x_behavior_arg - ((nglyphs - 1) % control_characters[cur_cc].x_behavior_arg);
@@ -398,53 +429,74 @@ static void draw_text_with_cc(cairo_t *ctx, text_t text, double start_x) {
             if (control_characters[cur_cc].y_behavior == CC_POS_CHANGE) {
                 lineno += control_characters[cur_cc].y_behavior_arg;
             } // CC_POS_KEEP is default for y
+            len++;
         }
-        y = text.y + text.size * lineno;
-        if (len > is_cc) {
+        y = size * lineno;
+        if (glyphs) {
             cairo_glyph_free(glyphs);
         }
-        nglyphs = 0;
-        start += len;
-        len = 0;
+        str += len;
+    }
+}
+
+/* Returns where the layout of text starts, given its alignment. */
+static double text_origin_x(const text_t *text, const text_layout_t *layout) {
+    switch (text->align) {
+        case 1:
+            return text->x;
+        case 2:
+            return text->x - (layout->extents.width + layout->extents.x_bearing);
+        case 0:
+        default:
+            return text->x - layout->extents.x_advance / 2;
     }
-    cairo_scaled_font_destroy(sft);
 }
 
 /*
- * Draws the given text onto the cairo context
+ * Draws the given text onto the cairo context. The shaped string and the
+ * rasterized glyphs come from the text cache, so unchanged text is only
+ * blitted.
  */
 static void draw_text(cairo_t *ctx, text_t text) {
     if (!text.show)
         return;
-    cairo_text_extents_t extents;
-    cairo_set_font_face(ctx, text.font);
-    cairo_set_font_size(ctx, text.size);
 
-    cairo_text_extents(ctx, text.str, &extents);
-
-    double x;
+    text_layout_t layout;
+    if (!text_cache_layout(ctx, text.font, text.size, text.str, layout_text_with_cc, &layout))
+        return;
 
-    switch (text.align) {
-        case 1:
-            x = text.x;
-            break;
-        case 2:
-            x = text.x - (extents.width + extents.x_bearing);
-            break;
-        case 0:
-        default:
-            x = text.x - extents.x_advance / 2;
-            break;
-    }
+    text_cache_draw(ctx, text.font, text.size, &layout, text_origin_x(&text, &layout), text.y,
+                    text.color, text.outline_color, text.outline_width);
+    text_layout_free(&layout);
+}
 
-    cairo_set_source_rgba(ctx, text.color.red, text.color.green, text.color.blue, text.color.alpha);
+/*
+ * Computes the screen pixels str covers when drawn like text on ctx (which
+ * is scaled by scaling_factor), outline included. Returns false if the text
+ * cannot be laid out.
+ */
+static bool text_bounds(cairo_t *ctx, const text_t *text, const char *str, double scaling_factor,
+                        cairo_rectangle_int_t *bounds) {
+    text_layout_t layout;
+    if (!text_cache_layout(ctx, text->font, text->size, str, layout_text_with_cc, &layout))
+        return false;
 
-    draw_text_with_cc(ctx, text, x);
-    cairo_fill_preserve(ctx);
+    cairo_text_extents_t ink;
+    cairo_save(ctx);
+    cairo_set_font_face(ctx, text->font);
+    cairo_set_font_size(ctx, text->size);
+    cairo_glyph_extents(ctx, layout.glyphs, layout.num_glyphs, &ink);
+    cairo_restore(ctx);
 
-    cairo_set_source_rgba(ctx, text.outline_color.red, text.outline_color.green, text.outline_color.blue, text.outline_color.alpha);
-    cairo_set_line_width(ctx, text.outline_width);
-    cairo_stroke(ctx);
+    /* one extra pixel for antialiasing, like the sprites */
+    const double pad = text->outline_width + 1;
+    const double x0 = text_origin_x(text, &layout) + ink.x_bearing - pad, y0 = text->y + ink.y_bearing - pad;
+    const int left = floor(x0 * scaling_factor) - 1, top = floor(y0 * scaling_factor) - 1;
+    *bounds = (cairo_rectangle_int_t){left, top,
+                                      (int)ceil((x0 + ink.width + 2 * pad) * scaling_factor) + 1 - left,
+                                      (int)ceil((y0 + ink.height + 2 * pad) * scaling_factor) + 1 - top};
+    text_layout_free(&layout);
+    return true;
 }
 
 static void draw_single_bar(cairo_t *ctx, double pos, double offset, double width, double height) {
@@ -461,11 +513,11 @@ static void draw_single_bar(cairo_t *ctx, double pos, double offset, double widt
     cairo_fill(ctx);
 }
 
-static void draw_bar(cairo_t *ctx, double bar_x, double bar_y, double bar_width, double screen_x, double screen_y) {
+static void draw_bar(cairo_t *ctx, const draw_snapshot_t *snap, const double *heights, double bar_x, double bar_y, double bar_width, double screen_x, double screen_y) {
 
     cairo_save(ctx);
 
-    switch (auth_state) {
+    switch (snap->auth_state) {
         case STATE_AUTH_VERIFY:
         case STATE_AUTH_LOCK:
             cairo_set_source_rgba(ctx, ringver16.red, ringver16.green, ringver16.blue, ringver16.alpha);
@@ -484,7 +536,7 @@ static void draw_bar(cairo_t *ctx, double bar_x, double bar_y, double bar_width,
     else
         draw_single_bar(ctx, bar_x, bar_y, bar_width, bar_base_height);
 
-    if (unlock_state == STATE_BACKSPACE_ACTIVE)
+    if (snap->unlock_state == STATE_BACKSPACE_ACTIVE)
         cairo_set_source_rgba(ctx, bshl16.red, bshl16.green, bshl16.blue, bshl16.alpha);
     else
         cairo_set_source_rgba(ctx, keyhl16.red, keyhl16.green, keyhl16.blue, keyhl16.alpha);
@@ -502,107 +554,172 @@ static void draw_bar(cairo_t *ctx, double bar_x, double bar_y, double bar_width,
     }
 
     for (int i = 0; i < bar_count; ++i) {
-        double bar_height = bar_heights[i];
+        double bar_height = heights[i];
         if (bar_bidirectional) bar_height *= 2;
         if (bar_height > 0) {
             draw_single_bar(ctx, bar_pos + i * base_width, bar_offset, base_width, bar_height);
         }
     }
 
-    for (int i = 0; i < bar_count; ++i) {
-        if (bar_heights[i] > 0) {
-            bar_heights[i] -= bar_periodic_step;
-        }
-    }
-
     cairo_restore(ctx);
 }
 
-static void draw_indic(cairo_t *ctx, double ind_x, double ind_y) {
-    if (unlock_indicator &&
-        (unlock_state >= STATE_KEY_PRESSED || auth_state > STATE_AUTH_IDLE || show_indicator)) {
-        /* Draw a (centered) circle with transparent background. */
-        cairo_set_line_width(ctx, RING_WIDTH);
-        cairo_arc(ctx, ind_x, ind_y, BUTTON_RADIUS, 0, 2 * M_PI);
-
-        /* Use the appropriate color for the different PAM states
-         * (currently verifying, wrong password, or default) */
-        switch (auth_state) {
-            case STATE_AUTH_VERIFY:
-            case STATE_AUTH_LOCK:
-                cairo_set_source_rgba(ctx, insidever16.red, insidever16.green, insidever16.blue, insidever16.alpha);
-                break;
-            case STATE_AUTH_WRONG:
-            case STATE_I3LOCK_LOCK_FAILED:
-                cairo_set_source_rgba(ctx, insidewrong16.red, insidewrong16.green, insidewrong16.blue, insidewrong16.alpha);
-                break;
-            default:
-                if (unlock_state == STATE_NOTHING_TO_DELETE) {
-                    cairo_set_source_rgba(ctx, insidewrong16.red, insidewrong16.green, insidewrong16.blue, insidewrong16.alpha);
-                    break;
-                }
-                cairo_set_source_rgba(ctx, inside16.red, inside16.green, inside16.blue, inside16.alpha);
-                break;
-        }
-        cairo_fill_preserve(ctx);
+/*
+ * The static part of the indicator (inside, ring and separator line) only
+ * depends on these states, so it is rendered once per state into a sprite.
+ */
+typedef enum {
+    INDIC_IDLE = 0,
+    INDIC_NOTHING_TO_DELETE,
+    INDIC_VERIFY,
+    INDIC_WRONG,
+    INDIC_SPRITE_COUNT,
+} indic_sprite_t;
+
+static pthread_mutex_t indic_sprites_mutex = PTHREAD_MUTEX_INITIALIZER;
+static cairo_surface_t *indic_sprites[INDIC_SPRITE_COUNT];
+/* device scale the sprites were rendered at */
+static double indic_sprites_scale_x = 0, indic_sprites_scale_y = 0;
+
+static indic_sprite_t indic_sprite_for(const draw_snapshot_t *snap) {
+    switch (snap->auth_state) {
+        case STATE_AUTH_VERIFY:
+        case STATE_AUTH_LOCK:
+            return INDIC_VERIFY;
+        case STATE_AUTH_WRONG:
+        case STATE_I3LOCK_LOCK_FAILED:
+            return INDIC_WRONG;
+        default:
+            if (snap->unlock_state == STATE_NOTHING_TO_DELETE)
+                return INDIC_NOTHING_TO_DELETE;
+            return INDIC_IDLE;
+    }
+}
 
-        switch (auth_state) {
-            case STATE_AUTH_VERIFY:
-            case STATE_AUTH_LOCK:
-                cairo_set_source_rgba(ctx, ringver16.red, ringver16.green, ringver16.blue, ringver16.alpha);
-                if (internal_line_source == 1) {
-                    line16.red = ringver16.red;
-                    line16.green = ringver16.green;
-                    line16.blue = ringver16.blue;
-                    line16.alpha = ringver16.alpha;
-                }
-                break;
-            case STATE_AUTH_WRONG:
-            case STATE_I3LOCK_LOCK_FAILED:
-                cairo_set_source_rgba(ctx, ringwrong16.red, ringwrong16.green, ringwrong16.blue, ringwrong16.alpha);
-                if (internal_line_source == 1) {
-                    line16.red = ringwrong16.red;
-                    line16.green = ringwrong16.green;
-                    line16.blue = ringwrong16.blue;
-                    line16.alpha = ringwrong16.alpha;
-                }
-                break;
-            case STATE_AUTH_IDLE:
-                if (unlock_state == STATE_NOTHING_TO_DELETE) {
-                    cairo_set_source_rgba(ctx, ringwrong16.red, ringwrong16.green, ringwrong16.blue, ringwrong16.alpha);
-                    if (internal_line_source == 1) {
-                        line16.red = ringwrong16.red;
-                        line16.green = ringwrong16.green;
-                        line16.blue = ringwrong16.blue;
-                        line16.alpha = ringwrong16.alpha;
-                    }
-                    break;
-                }
-                cairo_set_source_rgba(ctx, ring16.red, ring16.green, ring16.blue, ring16.alpha);
-                if (internal_line_source == 1) {
-                    line16.red = ring16.red;
-                    line16.green = ring16.green;
-                    line16.blue = ring16.blue;
-                    line16.alpha = ring16.alpha;
-                }
-                break;
-        }
+/*
+ * Draws the inside, the ring and the inner separator line of the indicator
+ * in the given state.
+ */
+static void draw_indic_static(cairo_t *ctx, indic_sprite_t which, double ind_x, double ind_y) {
+    rgba_t line = line16;
+
+    /* Draw a (centered) circle with transparent background. */
+    cairo_set_line_width(ctx, RING_WIDTH);
+    cairo_arc(ctx, ind_x, ind_y, BUTTON_RADIUS, 0, 2 * M_PI);
+
+    /* Use the appropriate color for the different PAM states
+     * (currently verifying, wrong password, or default) */
+    switch (which) {
+        case INDIC_VERIFY:
+            cairo_set_source_rgba(ctx, insidever16.red, insidever16.green, insidever16.blue, insidever16.alpha);
+            break;
+        case INDIC_WRONG:
+        case INDIC_NOTHING_TO_DELETE:
+            cairo_set_source_rgba(ctx, insidewrong16.red, insidewrong16.green, insidewrong16.blue, insidewrong16.alpha);
+            break;
+        default:
+            cairo_set_source_rgba(ctx, inside16.red, inside16.green, inside16.blue, inside16.alpha);
+            break;
+    }
+    cairo_fill_preserve(ctx);
+
+    switch (which) {
+        case INDIC_VERIFY:
+            cairo_set_source_rgba(ctx, ringver16.red, ringver16.green, ringver16.blue, ringver16.alpha);
+            if (internal_line_source == 1) {
+                line = ringver16;
+            }
+            break;
+        case INDIC_WRONG:
+        case INDIC_NOTHING_TO_DELETE:
+            cairo_set_source_rgba(ctx, ringwrong16.red, ringwrong16.green, ringwrong16.blue, ringwrong16.alpha);
+            if (internal_line_source == 1) {
+                line = ringwrong16;
+            }
+            break;
+        default:
+            cairo_set_source_rgba(ctx, ring16.red, ring16.green, ring16.blue, ring16.alpha);
+            if (internal_line_source == 1) {
+                line = ring16;
+            }
+            break;
+    }
+    cairo_stroke(ctx);
+
+    /* Draw an inner separator line. */
+    if (internal_line_source != 2) {  //pretty sure this only needs drawn if it's being drawn over the inside?
+        cairo_set_source_rgba(ctx, line.red, line.green, line.blue, line.alpha);
+        cairo_set_line_width(ctx, 2.0);
+        cairo_arc(ctx, ind_x, ind_y, BUTTON_RADIUS - 5, 0, 2 * M_PI);
         cairo_stroke(ctx);
+    }
+}
 
-        /* Draw an inner separator line. */
-        if (internal_line_source != 2) {  //pretty sure this only needs drawn if it's being drawn over the inside?
-            cairo_set_source_rgba(ctx, line16.red, line16.green, line16.blue, line16.alpha);
-            cairo_set_line_width(ctx, 2.0);
-            cairo_arc(ctx, ind_x, ind_y, BUTTON_RADIUS - 5, 0, 2 * M_PI);
-            cairo_stroke(ctx);
+/*
+ * Returns a reference to the sprite for the given state at the given device
+ * scale, rendering it on first use (or when the scale changed). The sprite is
+ * centered on the indicator position.
+ */
+static cairo_surface_t *get_indic_sprite(indic_sprite_t which, double scale_x, double scale_y) {
+    pthread_mutex_lock(&indic_sprites_mutex);
+    if (scale_x != indic_sprites_scale_x || scale_y != indic_sprites_scale_y) {
+        for (int i = 0; i < INDIC_SPRITE_COUNT; i++) {
+            if (indic_sprites[i])
+                cairo_surface_destroy(indic_sprites[i]);
+            indic_sprites[i] = NULL;
         }
-        if (unlock_state == STATE_KEY_ACTIVE || unlock_state == STATE_BACKSPACE_ACTIVE) {
+        indic_sprites_scale_x = scale_x;
+        indic_sprites_scale_y = scale_y;
+    }
+
+    if (!indic_sprites[which]) {
+        /* one extra pixel for antialiasing */
+        const double extent = BUTTON_SPACE + 1;
+        const int half_width = ceil(extent * scale_x);
+        const int half_height = ceil(extent * scale_y);
+        cairo_surface_t *sprite = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 2 * half_width, 2 * half_height);
+        cairo_t *ctx = cairo_create(sprite);
+        cairo_translate(ctx, half_width, half_height);
+        cairo_scale(ctx, scale_x, scale_y);
+        draw_indic_static(ctx, which, 0, 0);
+        cairo_destroy(ctx);
+        indic_sprites[which] = sprite;
+    }
+
+    cairo_surface_t *sprite = cairo_surface_reference(indic_sprites[which]);
+    pthread_mutex_unlock(&indic_sprites_mutex);
+    return sprite;
+}
+
+static void draw_indic(cairo_t *ctx, const draw_snapshot_t *snap, double ind_x, double ind_y, double highlight_start) {
+    if (unlock_indicator &&
+        (snap->unlock_state >= STATE_KEY_PRESSED || snap->auth_state > STATE_AUTH_IDLE || show_indicator)) {
+        /* Blit the pre-rendered inside and ring for the current state,
+         * centered on the (pixel aligned) indicator position. */
+        cairo_matrix_t ctm;
+        cairo_get_matrix(ctx, &ctm);
+        cairo_surface_t *sprite = get_indic_sprite(indic_sprite_for(snap), ctm.xx, ctm.yy);
+        double dx = ind_x, dy = ind_y;
+        cairo_matrix_transform_point(&ctm, &dx, &dy);
+        const int width = cairo_image_surface_get_width(sprite);
+        const int height = cairo_image_surface_get_height(sprite);
+        dx = round(dx) - width / 2;
+        dy = round(dy) - height / 2;
+
+        cairo_save(ctx);
+        cairo_identity_matrix(ctx);
+        cairo_set_source_surface(ctx, sprite, dx, dy);
+        cairo_rectangle(ctx, dx, dy, width, height);
+        cairo_fill(ctx);
+        cairo_restore(ctx);
+        cairo_surface_destroy(sprite);
+
+        if (snap->unlock_state == STATE_KEY_ACTIVE || snap->unlock_state == STATE_BACKSPACE_ACTIVE) {
             cairo_set_line_width(ctx, RING_WIDTH);
             cairo_new_sub_path(ctx);
-            double highlight_start = (rand() % (int)(2 * M_PI * 100)) / 100.0;
             cairo_arc(ctx, ind_x, ind_y, BUTTON_RADIUS,
                       highlight_start, highlight_start + (M_PI / 3.0));
-            if (unlock_state == STATE_KEY_ACTIVE) {
+            if (snap->unlock_state == STATE_KEY_ACTIVE) {
                 /* For normal keys, we use a lighter green. */
                 cairo_set_source_rgba(ctx, keyhl16.red, keyhl16.green, keyhl16.blue, keyhl16.alpha);
             } else {
@@ -718,35 +835,64 @@ static DrawData create_draw_data() {
     return draw_data;
 }
 
-static void draw_elements(cairo_t *const ctx, DrawData const *const draw_data) {
+/*
+ * Advances the bar animation by one drawn screen: adds a peak around a random
+ * bar for keypresses, stores the heights to draw in heights_out and lets the
+ * bars decay. Called serially for every screen before drawing.
+ */
+static void step_bar_heights(const draw_snapshot_t *snap, double *heights_out) {
+    if (snap->unlock_state == STATE_KEY_ACTIVE ||
+        snap->unlock_state == STATE_BACKSPACE_ACTIVE) {
+        // note: might be biased to cause more hits on lower indices
+        // maybe see about doing ((double) rand() / RAND_MAX) * bar_count
+        int index = rand() % bar_count;
+        bar_heights[index] = max_bar_height;
+        for (int i = 0; i < ((max_bar_height / bar_step) + 1); ++i) {
+            int low_ind = index - i;
+            while (low_ind < 0) {
+                low_ind += bar_count;
+            }
+            int high_ind = (index + i) % bar_count;
+            int tmp_height = max_bar_height - (bar_step * i);
+            if (tmp_height < 0)
+                tmp_height = 0;
+            if (bar_heights[low_ind] < tmp_height)
+                bar_heights[low_ind] = tmp_height;
+            if (bar_heights[high_ind] < tmp_height)
+                bar_heights[high_ind] = tmp_height;
+            if (tmp_height == 0)
+                break;
+        }
+    }
+
+    memcpy(heights_out, bar_heights, bar_count * sizeof(double));
+
+    for (int i = 0; i < bar_count; ++i) {
+        if (bar_heights[i] > 0) {
+            bar_heights[i] -= bar_periodic_step;
+        }
+    }
+}
+
+/*
+ * Fills in the per-screen animation state (highlight position, bar heights)
+ * of draw_data. heights must hold bar_count values when the bar is enabled.
+ */
+static void prepare_draw_data(const draw_snapshot_t *snap, DrawData *draw_data, double *heights) {
+    if (!bar_enabled) {
+        draw_data->highlight_start = (rand() % (int)(2 * M_PI * 100)) / 100.0;
+    } else {
+        step_bar_heights(snap, heights);
+        draw_data->bar_heights = heights;
+    }
+}
+
+static void draw_elements(cairo_t *const ctx, const draw_snapshot_t *snap, DrawData const *const draw_data) {
     // indicator stuff
     if (!bar_enabled) {
-        draw_indic(ctx, draw_data->indicator_x, draw_data->indicator_y);
+        draw_indic(ctx, snap, draw_data->indicator_x, draw_data->indicator_y, draw_data->highlight_start);
     } else {
-        if (unlock_state == STATE_KEY_ACTIVE ||
-            unlock_state == STATE_BACKSPACE_ACTIVE) {
-            // note: might be biased to cause more hits on lower indices
-            // maybe see about doing ((double) rand() / RAND_MAX) * bar_count
-            int index = rand() % bar_count;
-            bar_heights[index] = max_bar_height;
-            for (int i = 0; i < ((max_bar_height / bar_step) + 1); ++i) {
-                int low_ind = index - i;
-                while (low_ind < 0) {
-                    low_ind += bar_count;
-                }
-                int high_ind = (index + i) % bar_count;
-                int tmp_height = max_bar_height - (bar_step * i);
-                if (tmp_height < 0)
-                    tmp_height = 0;
-                if (bar_heights[low_ind] < tmp_height)
-                    bar_heights[low_ind] = tmp_height;
-                if (bar_heights[high_ind] < tmp_height)
-                    bar_heights[high_ind] = tmp_height;
-                if (tmp_height == 0)
-                    break;
-            }
-        }
-        draw_bar(ctx, draw_data->bar_x, draw_data->bar_y, draw_data->bar_width, draw_data->screen_x, draw_data->screen_y);
+        draw_bar(ctx, snap, draw_data->bar_heights, draw_data->bar_x, draw_data->bar_y, draw_data->bar_width, draw_data->screen_x, draw_data->screen_y);
     }
 
     draw_text(ctx, draw_data->status_text);
@@ -758,50 +904,381 @@ static void draw_elements(cairo_t *const ctx, DrawData const *const draw_data) {
 }
 
 /*
- * Renders the lock screen on the provided drawable with the given resolution.
+ * Computes where draw_image_on_screen() puts the image on a screen: image
+ * pixel (x, y) ends up at (x * scale_x - offset_x, y * scale_y - offset_y).
  */
-void render_lock(uint32_t *resolution, xcb_drawable_t drawable) {
+static void image_placement(cairo_surface_t *img, const Rect *screen, double *scale_x, double *scale_y,
+                            double *offset_x, double *offset_y) {
+    double image_width = cairo_image_surface_get_width(img);
+    double image_height = cairo_image_surface_get_height(img);
+
+    // Find out scaling factors using bg_type and aspect ratios
+    *scale_x = *scale_y = 1;
+    if (bg_type == SCALE) {
+        *scale_x = screen->width / image_width;
+        *scale_y = screen->height / image_height;
+
+    } else if (bg_type == MAX || bg_type == FILL) {
+        double aspect_diff = (double) screen->height / screen->width - image_height / image_width;
+        if((bg_type == MAX && aspect_diff >= 0) || (bg_type == FILL && aspect_diff <= 0)) {
+            *scale_x = *scale_y = screen->width / image_width;
+        } else if ((bg_type == MAX && aspect_diff < 0) || (bg_type == FILL && aspect_diff > 0)) {
+            *scale_x = *scale_y = screen->height / image_height;
+        }
+    }
+
+    if (bg_type == TILE) {
+        // Start image from top-left corner
+        *offset_x = -screen->x;
+        *offset_y = -screen->y;
+    } else {
+        // Draw image in the center of the screen
+        *offset_x = (image_width  * *scale_x - screen->width ) / 2 - screen->x;
+        *offset_y = (image_height * *scale_y - screen->height) / 2 - screen->y;
+    }
+}
+
+/*
+ * Draws the configured image for a single screen on the provided context. The
+ * image is centered on the screen, tiled, or just painted starting from 0,0.
+ * It is also scaled if bg_type is FILL, MAX, or SCALE.
+ */
+static void draw_image_on_screen(cairo_surface_t *img, const Rect *screen, cairo_t *ctx) {
+    if (bg_type == NONE) {
+        // Don't do any image manipulation
+        cairo_set_source_surface(ctx, img, 0, 0);
+        cairo_paint(ctx);
+        return;
+    }
+
+    cairo_pattern_t *pattern = cairo_pattern_create_for_surface(img);
+    cairo_pattern_set_extend(pattern, bg_type == TILE ? CAIRO_EXTEND_REPEAT : CAIRO_EXTEND_NONE);
+    cairo_set_source(ctx, pattern);
+
+    double scale_x, scale_y, offset_x, offset_y;
+    image_placement(img, screen, &scale_x, &scale_y, &offset_x, &offset_y);
+
+    // Scale and translate the pattern
+    cairo_matrix_t matrix;
+    cairo_matrix_init_scale(&matrix, 1/scale_x, 1/scale_y);
+    cairo_matrix_translate(&matrix, offset_x, offset_y);
+    cairo_pattern_set_matrix(pattern, &matrix);
+
+    // Draw to screen
+    cairo_rectangle(ctx, screen->x, screen->y, screen->width, screen->height);
+    cairo_fill(ctx);
+
+    cairo_pattern_destroy(pattern);
+}
+
+/*
+ * Clips r to the given area. Returns false if nothing of r is left.
+ */
+static bool intersect_rect(cairo_rectangle_int_t *r, int x, int y, int width, int height) {
+    int x0 = r->x > x ? r->x : x;
+    int y0 = r->y > y ? r->y : y;
+    int x1 = r->x + r->width < x + width ? r->x + r->width : x + width;
+    int y1 = r->y + r->height < y + height ? r->y + r->height : y + height;
+    if (x1 <= x0 || y1 <= y0)
+        return false;
+    *r = (cairo_rectangle_int_t){x0, y0, x1 - x0, y1 - y0};
+    return true;
+}
+
+/*
+ * Grows r to cover other as well.
+ */
+static void union_rect(cairo_rectangle_int_t *r, const cairo_rectangle_int_t *other) {
+    int x1 = r->x + r->width > other->x + other->width ? r->x + r->width : other->x + other->width;
+    int y1 = r->y + r->height > other->y + other->height ? r->y + r->height : other->y + other->height;
+    r->x = r->x < other->x ? r->x : other->x;
+    r->y = r->y < other->y ? r->y : other->y;
+    r->width = x1 - r->x;
+    r->height = y1 - r->y;
+}
+
+/*
+ * Returns a context to measure text with, scaled like the ones drawn on.
+ */
+static cairo_t *create_measuring_context(double scaling_factor) {
+    cairo_surface_t *scratch = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 1, 1);
+    cairo_t *ctx = cairo_create(scratch);
+    /* the context holds its own reference */
+    cairo_surface_destroy(scratch);
+    cairo_scale(ctx, scaling_factor, scaling_factor);
+    return ctx;
+}
+
+/*
+ * Maps a rectangle of the image surface (in image pixels) to the parts of the
+ * screen it is drawn on, padded by a pixel for the filtering of scaled
+ * images. Returns the number of rectangles stored in damage, or 0 if the
+ * whole screen has to be redrawn instead, e.g. because the snapshot shows
+ * another image by now.
+ */
+static int image_damage(const draw_snapshot_t *snap, cairo_surface_t *surface, const cairo_rectangle_int_t *rect,
+                        cairo_rectangle_int_t *damage) {
+    if (!snap->img || snap->img != surface || bg_type == TILE)
+        return 0;
+
+    if (bg_type == NONE) {
+        damage[0] = *rect;
+        return intersect_rect(&damage[0], 0, 0, snap->resolution[0], snap->resolution[1]) ? 1 : 0;
+    }
+
+    int count = 0;
+    for (int i = 0; i < snap->screen_count; i++) {
+        const Rect *screen = &snap->screens[i];
+        double scale_x, scale_y, offset_x, offset_y;
+        image_placement(snap->img, screen, &scale_x, &scale_y, &offset_x, &offset_y);
+
+        int x0 = floor(rect->x * scale_x - offset_x) - 1;
+        int y0 = floor(rect->y * scale_y - offset_y) - 1;
+        int x1 = ceil((rect->x + rect->width) * scale_x - offset_x) + 1;
+        int y1 = ceil((rect->y + rect->height) * scale_y - offset_y) + 1;
+        cairo_rectangle_int_t r = {x0, y0, x1 - x0, y1 - y0};
+        if (!intersect_rect(&r, screen->x, screen->y, screen->width, screen->height))
+            continue;
+        if (count == MAX_DAMAGE_RECTS)
+            return 0;
+        damage[count++] = r;
+    }
+    return count;
+}
+
+/*
+ * Restricts drawing on ctx (in screen pixels) to the damaged parts of the
+ * snapshot, if it only covers a part of the screen.
+ */
+static void clip_to_damage(cairo_t *ctx, const draw_snapshot_t *snap) {
+    if (snap->damage_count == 0)
+        return;
+    for (int i = 0; i < snap->damage_count; i++) {
+        const cairo_rectangle_int_t *r = &snap->damage[i];
+        cairo_rectangle(ctx, r->x, r->y, r->width, r->height);
+    }
+    cairo_clip(ctx);
+}
+
+static bool damage_intersects(const draw_snapshot_t *snap, const Rect *screen) {
+    if (snap->damage_count == 0)
+        return true;
+    for (int i = 0; i < snap->damage_count; i++) {
+        cairo_rectangle_int_t r = snap->damage[i];
+        if (intersect_rect(&r, screen->x, screen->y, screen->width, screen->height))
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Draws the configured image on the provided context, once per monitor.
+ */
+void draw_image(const draw_snapshot_t *snap, cairo_surface_t *img, cairo_t* xcb_ctx) {
+    if (bg_type == NONE) {
+        draw_image_on_screen(img, NULL, xcb_ctx);
+        return;
+    }
+
+    for (int i = 0; i < snap->screen_count; i++) {
+        draw_image_on_screen(img, &snap->screens[i], xcb_ctx);
+    }
+}
+
+typedef struct {
+    DrawData draw_data;
+    bool has_elements;
+    /* what the elements cover, see element_bounds() */
+    cairo_rectangle_int_t bounds;
+    cairo_surface_t *surface;
+} screen_tile_t;
+
+typedef struct {
+    const draw_snapshot_t *snap;
+    screen_tile_t *tiles;
+    double scaling_factor;
+} tile_job_t;
+
+/* Whether the elements of the given screen reach into the screen rect. */
+static bool elements_reach(const tile_job_t *job, int screen, const Rect *rect) {
+    const screen_tile_t *tile = &job->tiles[screen];
+    cairo_rectangle_int_t r = tile->bounds;
+    return tile->has_elements && intersect_rect(&r, rect->x, rect->y, rect->width, rect->height);
+}
+
+/*
+ * Renders the background image of one screen into a tile the size of that
+ * screen, plus the elements of every screen that reach into it, so that
+ * elements crossing the edge between two screens are not cut off. Runs on
+ * the worker pool, one call per screen.
+ */
+static void render_tile(void *arg, int index) {
+    tile_job_t *job = arg;
+    screen_tile_t *tile = &job->tiles[index];
+    const Rect *rect = &job->snap->screens[index];
+
+    bool has_elements = false;
+    for (int i = 0; i < job->snap->screen_count && !has_elements; i++)
+        has_elements = elements_reach(job, i, rect);
+    if (!has_elements && !job->snap->img)
+        return;
+    if (!damage_intersects(job->snap, rect))
+        return;
+
+    tile->surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, rect->width, rect->height);
+    cairo_t *ctx = cairo_create(tile->surface);
+    cairo_translate(ctx, -rect->x, -rect->y);
+    clip_to_damage(ctx, job->snap);
+
+    if (job->snap->img)
+        draw_image_on_screen(job->snap->img, rect, ctx);
+
+    if (has_elements) {
+        cairo_scale(ctx, job->scaling_factor, job->scaling_factor);
+        for (int i = 0; i < job->snap->screen_count; i++) {
+            if (elements_reach(job, i, rect))
+                draw_elements(ctx, job->snap, &job->tiles[i].draw_data);
+        }
+    }
+
+    cairo_destroy(ctx);
+}
+
+/* Where the last render put the indicator (or the bar) on each screen, in
+ * screen pixels. render_snapshot() and present_snapshot() never run at the
+ * same time, see render_lock(). */
+static cairo_rectangle_int_t indicator_bounds[MAX_DAMAGE_RECTS];
+static int indicator_bounds_count = 0;
+
+/* The time and date texts of the last render on each screen, so that a new
+ * clock can be redrawn without the rest of the screen. */
+static text_t clock_texts[2 * MAX_DAMAGE_RECTS];
+static int clock_text_count = 0;
+static double clock_scaling_factor;
+
+static void add_clock_texts(const DrawData *draw_data, double scaling_factor) {
+    if (clock_text_count == 2 * MAX_DAMAGE_RECTS)
+        return;
+    clock_texts[clock_text_count++] = draw_data->time_text;
+    clock_texts[clock_text_count++] = draw_data->date_text;
+    clock_scaling_factor = scaling_factor;
+}
+
+/* Sets the clock of snap to the current time, in the configured formats. */
+static void stamp_clock(draw_snapshot_t *snap) {
+    snap->time_text[0] = snap->date_text[0] = '\0';
+    if (!show_clock)
+        return;
+
+    time_t rawtime;
+    time(&rawtime);
+    struct tm *timeinfo = localtime(&rawtime);
+    strftime(snap->time_text, sizeof(snap->time_text), time_format, timeinfo);
+    strftime(snap->date_text, sizeof(snap->date_text), date_format, timeinfo);
+}
+
+/* Computes the bounding box of the indicator or the bar of one screen, in
+ * screen pixels. */
+static cairo_rectangle_int_t indicator_rect(const DrawData *draw_data, double scaling_factor) {
+    double x0, y0, x1, y1;
+    if (!bar_enabled) {
+        /* one extra pixel for antialiasing, like the sprites */
+        const double extent = BUTTON_SPACE + 1;
+        x0 = draw_data->indicator_x - extent;
+        y0 = draw_data->indicator_y - extent;
+        x1 = draw_data->indicator_x + extent;
+        y1 = draw_data->indicator_y + extent;
+    } else {
+        /* bars grow away from their offset, to one or both sides */
+        const double reach = max_bar_height > bar_base_height ? max_bar_height : bar_base_height;
+        if (bar_orientation == BAR_VERT) {
+            x0 = draw_data->bar_x - reach;
+            x1 = draw_data->bar_x + reach;
+            y0 = draw_data->bar_y;
+            y1 = draw_data->bar_y + draw_data->bar_width;
+        } else {
+            x0 = draw_data->bar_x;
+            x1 = draw_data->bar_x + draw_data->bar_width;
+            y0 = draw_data->bar_y - reach;
+            y1 = draw_data->bar_y + reach;
+        }
+    }
+
+    const int left = floor(x0 * scaling_factor) - 1, top = floor(y0 * scaling_factor) - 1;
+    return (cairo_rectangle_int_t){
+        left, top, (int)ceil(x1 * scaling_factor) + 1 - left, (int)ceil(y1 * scaling_factor) + 1 - top};
+}
+
+/* Records the bounding box of the indicator or the bar of one screen. */
+static void add_indicator_bounds(const DrawData *draw_data, double scaling_factor) {
+    if (indicator_bounds_count == MAX_DAMAGE_RECTS)
+        return;
+    indicator_bounds[indicator_bounds_count++] = indicator_rect(draw_data, scaling_factor);
+}
+
+/*
+ * Computes the bounding box of everything draw_elements() draws for one
+ * screen, in screen pixels. Texts may reach into the neighbouring screens.
+ */
+static cairo_rectangle_int_t element_bounds(cairo_t *measure, const DrawData *draw_data, double scaling_factor) {
+    const text_t *texts[] = {&draw_data->status_text, &draw_data->keylayout_text, &draw_data->mod_text,
+                             &draw_data->time_text, &draw_data->date_text, &draw_data->greeter_text};
+    cairo_rectangle_int_t bounds = indicator_rect(draw_data, scaling_factor);
+    for (size_t i = 0; i < sizeof(texts) / sizeof(texts[0]); i++) {
+        cairo_rectangle_int_t r;
+        if (texts[i]->show && text_bounds(measure, texts[i], texts[i]->str, scaling_factor, &r))
+            union_rect(&bounds, &r);
+    }
+    return bounds;
+}
+
+/*
+ * Renders the given snapshot of the lock state on the provided drawable.
+ * Only reads from the snapshot (and from options which are fixed after
+ * startup), so it is safe to call from the redraw thread.
+ */
+static void render_snapshot(const draw_snapshot_t *snap, xcb_drawable_t drawable) {
+    const uint32_t *resolution = snap->resolution;
     const double scaling_factor = get_dpi_value() / 96.0;
     int button_diameter_physical = ceil(scaling_factor * BUTTON_DIAMETER);
     DEBUG("scaling_factor is %.f, physical diameter is %d px\n",
         scaling_factor, button_diameter_physical);
 
-    if (!vistype)
-        vistype = get_visualtype_by_depth(32, screen);
     /* Initialize cairo: Create one in-memory surface to render the unlock
      * indicator on, create one XCB surface to actually draw (one or more,
      * depending on the amount of screens) unlock indicators on.
      * create two more surfaces for time and date display
      */
-    cairo_surface_t *output = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, resolution[0], resolution[1]);
-    cairo_t *ctx = cairo_create(output);
-    cairo_scale(ctx, scaling_factor, scaling_factor);
+    /* With more than one screen, every screen is rendered into its own tile
+     * concurrently and the tiles are composited afterwards. */
+    const bool tiled = snap->screen_count > 1;
+    cairo_surface_t *output = NULL;
+    cairo_t *ctx = NULL;
+    /* the part of the screen output covers: damaged frames only need that */
+    cairo_rectangle_int_t area = {0, 0, resolution[0], resolution[1]};
+    if (!tiled) {
+        if (snap->damage_count > 0) {
+            cairo_rectangle_int_t damaged = snap->damage[0];
+            for (int i = 1; i < snap->damage_count; i++)
+                union_rect(&damaged, &snap->damage[i]);
+            if (!intersect_rect(&area, damaged.x, damaged.y, damaged.width, damaged.height))
+                area.width = area.height = 0;
+        }
+        output = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, area.width, area.height);
+        ctx = cairo_create(output);
+        cairo_translate(ctx, -area.x, -area.y);
+        clip_to_damage(ctx, snap);
+        cairo_scale(ctx, scaling_factor, scaling_factor);
+    }
 
     //    cairo_set_font_face(ctx, get_font_face(0));
 
     cairo_surface_t *xcb_output = cairo_xcb_surface_create(conn, drawable, vistype, resolution[0], resolution[1]);
     cairo_t *xcb_ctx = cairo_create(xcb_output);
+    clip_to_damage(xcb_ctx, snap);
 
-    /*update image according to the slideshow_interval*/
-    if (slideshow_image_count > 0) {
-        unsigned long now = (unsigned long)time(NULL);
-        if (img == NULL || now - lastCheck >= slideshow_interval) {
-            if (slideshow_random_selection) {
-                img = load_image(img_slideshow[rand() % slideshow_image_count]);
-            } else {
-                img = load_image(img_slideshow[current_slideshow_index]);
-            }
-            current_slideshow_index++;
-            if (current_slideshow_index >= slideshow_image_count) {
-                current_slideshow_index = 0;
-                load_slideshow_images(slideshow_path);
-            }
-            lastCheck = now;
-        }
-    }
-
-    if (blur_bg_img) {
-        cairo_set_source_surface(xcb_ctx, blur_bg_img, 0, 0);
+    if (snap->bg_img) {
+        cairo_set_source_surface(xcb_ctx, snap->bg_img, 0, 0);
         cairo_paint(xcb_ctx);
     } else {
         cairo_set_source_rgba(xcb_ctx, background.red, background.green, background.blue, background.alpha);
@@ -809,8 +1286,8 @@ void render_lock(uint32_t *resolution, xcb_drawable_t drawable) {
         cairo_fill(xcb_ctx);
     }
 
-    if (img) {
-        draw_image(resolution, img, xcb_ctx);
+    if (snap->img && !tiled) {
+        draw_image(snap, snap->img, xcb_ctx);
     }
 
     /*
@@ -823,8 +1300,8 @@ void render_lock(uint32_t *resolution, xcb_drawable_t drawable) {
     DrawData draw_data = create_draw_data();
 
     if (unlock_indicator &&
-        (unlock_state >= STATE_KEY_PRESSED || auth_state > STATE_AUTH_IDLE || show_indicator)) {
-        switch (auth_state) {
+        (snap->unlock_state >= STATE_KEY_PRESSED || snap->auth_state > STATE_AUTH_IDLE || show_indicator)) {
+        switch (snap->auth_state) {
             case STATE_AUTH_VERIFY:
                 draw_data.status_text.show = true;
                 strncpy(draw_data.status_text.str, verif_text, sizeof(draw_data.status_text.str) - 1);
@@ -866,7 +1343,7 @@ void render_lock(uint32_t *resolution, xcb_drawable_t drawable) {
                 draw_data.status_text.align = wrong_align;
                 break;
             default:
-                if (unlock_state == STATE_NOTHING_TO_DELETE) {
+                if (snap->unlock_state == STATE_NOTHING_TO_DELETE) {
                     draw_data.status_text.show = true;
                     strncpy(draw_data.status_text.str, noinput_text, sizeof(draw_data.status_text.str) - 1);
                     draw_data.status_text.font = get_font_face(WRONG_FONT);
@@ -877,7 +1354,7 @@ void render_lock(uint32_t *resolution, xcb_drawable_t drawable) {
                     draw_data.status_text.align = wrong_align;
                     break;
                 }
-                if (show_failed_attempts && failed_attempts > 0) {
+                if (show_failed_attempts && snap->failed_attempts > 0) {
                     draw_data.status_text.show = true;
                     draw_data.status_text.font = get_font_face(WRONG_FONT);
                     draw_data.status_text.color = wrong16;
@@ -887,19 +1364,19 @@ void render_lock(uint32_t *resolution, xcb_drawable_t drawable) {
                     draw_data.status_text.align = wrong_align;
                     // TODO: variable for this
                     draw_data.status_text.size = 32.0;
-                    if (failed_attempts > 999) {
+                    if (snap->failed_attempts > 999) {
                         strncpy(draw_data.status_text.str, "> 999", sizeof(draw_data.status_text.str));
                     } else {
-                        snprintf(draw_data.status_text.str, sizeof(draw_data.status_text.str), "%d", failed_attempts);
+                        snprintf(draw_data.status_text.str, sizeof(draw_data.status_text.str), "%d", snap->failed_attempts);
                     }
                 }
                 break;
         }
     }
 
-    if (modifier_string) {
+    if (snap->show_modifier) {
         draw_data.mod_text.show = true;
-        strncpy(draw_data.mod_text.str, modifier_string, sizeof(draw_data.mod_text.str) - 1);
+        strncpy(draw_data.mod_text.str, snap->modifier_text, sizeof(draw_data.mod_text.str) - 1);
         draw_data.mod_text.size = modifier_size;
         draw_data.mod_text.outline_width = modifieroutlinewidth;
         draw_data.mod_text.font = get_font_face(WRONG_FONT);
@@ -908,9 +1385,9 @@ void render_lock(uint32_t *resolution, xcb_drawable_t drawable) {
         draw_data.mod_text.outline_color = modifoutline16;
     }
 
-    if (layout_text) {
+    if (snap->show_layout) {
         draw_data.keylayout_text.show = true;
-        strncpy(draw_data.keylayout_text.str, layout_text, sizeof(draw_data.keylayout_text.str) - 1);
+        strncpy(draw_data.keylayout_text.str, snap->layout_text, sizeof(draw_data.keylayout_text.str) - 1);
         draw_data.keylayout_text.size = layout_size;
         draw_data.keylayout_text.outline_width = layoutoutlinewidth;
         draw_data.keylayout_text.font = get_font_face(LAYOUT_FONT);
@@ -931,31 +1408,25 @@ void render_lock(uint32_t *resolution, xcb_drawable_t drawable) {
     }
 
     if (show_clock && (!draw_data.status_text.show || always_show_clock)) {
-        time_t rawtime;
-        struct tm *timeinfo;
-        time(&rawtime);
-        timeinfo = localtime(&rawtime);
-
-        strftime(draw_data.time_text.str, 40, time_format, timeinfo);
-        if (*draw_data.time_text.str) {
-            draw_data.time_text.show = true;
-            draw_data.time_text.size = time_size;
-            draw_data.time_text.outline_width = timeoutlinewidth;
-            draw_data.time_text.color = time16;
-            draw_data.time_text.outline_color = timeoutline16;
-            draw_data.time_text.font = get_font_face(TIME_FONT);
-            draw_data.time_text.align = time_align;
-        }
-        strftime(draw_data.date_text.str, 40, date_format, timeinfo);
-        if (*draw_data.date_text.str) {
-            draw_data.date_text.show = true;
-            draw_data.date_text.size = date_size;
-            draw_data.date_text.outline_width = dateoutlinewidth;
-            draw_data.date_text.color = date16;
-            draw_data.date_text.outline_color = dateoutline16;
-            draw_data.date_text.font = get_font_face(DATE_FONT);
-            draw_data.date_text.align = date_align;
-        }
+        /* set up even when empty: add_clock_damage() measures the next
+         * clock with these */
+        strncpy(draw_data.time_text.str, snap->time_text, sizeof(draw_data.time_text.str) - 1);
+        draw_data.time_text.show = *draw_data.time_text.str != '\0';
+        draw_data.time_text.size = time_size;
+        draw_data.time_text.outline_width = timeoutlinewidth;
+        draw_data.time_text.color = time16;
+        draw_data.time_text.outline_color = timeoutline16;
+        draw_data.time_text.font = get_font_face(TIME_FONT);
+        draw_data.time_text.align = time_align;
+
+        strncpy(draw_data.date_text.str, snap->date_text, sizeof(draw_data.date_text.str) - 1);
+        draw_data.date_text.show = *draw_data.date_text.str != '\0';
+        draw_data.date_text.size = date_size;
+        draw_data.date_text.outline_width = dateoutlinewidth;
+        draw_data.date_text.color = date16;
+        draw_data.date_text.outline_color = dateoutline16;
+        draw_data.date_text.font = get_font_face(DATE_FONT);
+        draw_data.date_text.align = date_align;
 
         if (*draw_data.greeter_text.str) {
             draw_data.greeter_text.show = true;
@@ -1017,15 +1488,19 @@ void render_lock(uint32_t *resolution, xcb_drawable_t drawable) {
     te_expr *te_greeter_x_expr = compile_expression("--greeterpos", greeter_x_expr, vars, vars_size);
     te_expr *te_greeter_y_expr = compile_expression("--greeterpos", greeter_y_expr, vars, vars_size);
 
-    if (xr_screens > 0) {
-        if (screen_number < 0 || screen_number > xr_screens) {
-            screen_number = 0;
-        }
+    screen_tile_t *tiles = NULL;
+    double *heights = NULL;
+    if (bar_enabled)
+        heights = malloc((snap->screen_count > 0 ? snap->screen_count : 1) * bar_count * sizeof(double));
 
-        DEBUG("Drawing indicator on %d screens\n", screen_number);
+    indicator_bounds_count = 0;
+    clock_text_count = 0;
+    if (snap->screen_count > 0) {
+        tiles = calloc(snap->screen_count, sizeof(screen_tile_t));
+        DEBUG("Drawing indicator on %d screens\n", snap->screen_number);
 
-        int current_screen = screen_number == 0 ? 0 : screen_number - 1;
-        const int end_screen = screen_number == 0 ? xr_screens : screen_number;
+        int current_screen = snap->screen_number == 0 ? 0 : snap->screen_number - 1;
+        const int end_screen = snap->screen_number == 0 ? snap->screen_count : snap->screen_number;
         for (; current_screen < end_screen; current_screen++) {
             draw_data.indicator_x = 0;
             draw_data.indicator_y = 0;
@@ -1036,10 +1511,10 @@ void render_lock(uint32_t *resolution, xcb_drawable_t drawable) {
             draw_data.greeter_text.x = 0;
             draw_data.greeter_text.y = 0;
 
-            width = xr_resolutions[current_screen].width / scaling_factor;
-            height = xr_resolutions[current_screen].height / scaling_factor;
-            screen_x = xr_resolutions[current_screen].x / scaling_factor;
-            screen_y = xr_resolutions[current_screen].y / scaling_factor;
+            width = snap->screens[current_screen].width / scaling_factor;
+            height = snap->screens[current_screen].height / scaling_factor;
+            screen_x = snap->screens[current_screen].x / scaling_factor;
+            screen_y = snap->screens[current_screen].y / scaling_factor;
             draw_data.screen_x = screen_x;
             draw_data.screen_y = screen_y;
             draw_data.indicator_x = te_eval(te_ind_x_expr);
@@ -1053,7 +1528,7 @@ void render_lock(uint32_t *resolution, xcb_drawable_t drawable) {
             draw_data.greeter_text.x = te_eval(te_greeter_x_expr);
             draw_data.greeter_text.y = te_eval(te_greeter_y_expr);
 
-            switch (auth_state) {
+            switch (snap->auth_state) {
                 case STATE_AUTH_VERIFY:
                 case STATE_AUTH_LOCK:
                     draw_data.status_text.x = te_eval(te_verif_x_expr);
@@ -1102,14 +1577,32 @@ void render_lock(uint32_t *resolution, xcb_drawable_t drawable) {
             DEBUG("Status at %fx%f on screen %d\n", draw_data.status_text.x, draw_data.status_text.y, current_screen + 1);
             DEBUG("Mod at %fx%f on screen %d\n", draw_data.mod_text.x, draw_data.mod_text.y, current_screen + 1);
             // scale_draw_data(&draw_data, scaling_factor);
-            draw_elements(ctx, &draw_data);
+            prepare_draw_data(snap, &draw_data, heights ? heights + current_screen * bar_count : NULL);
+            add_indicator_bounds(&draw_data, scaling_factor);
+            add_clock_texts(&draw_data, scaling_factor);
+            tiles[current_screen].draw_data = draw_data;
+            tiles[current_screen].has_elements = true;
+        }
+
+        if (tiled) {
+            cairo_t *measure = create_measuring_context(scaling_factor);
+            for (int i = 0; i < snap->screen_count; i++) {
+                if (tiles[i].has_elements)
+                    tiles[i].bounds = element_bounds(measure, &tiles[i].draw_data, scaling_factor);
+            }
+            cairo_destroy(measure);
+
+            tile_job_t job = {snap, tiles, scaling_factor};
+            parallel_for(snap->screen_count, 0, render_tile, &job);
+        } else if (tiles[0].has_elements) {
+            draw_elements(ctx, snap, &tiles[0].draw_data);
         }
     } else {
         /* We have no information about the screen sizes/positions, so we just
          * place the unlock indicator in the middle of the X root window and
          * hope for the best. */
-        width = last_resolution[0] / scaling_factor;
-        height = last_resolution[1] / scaling_factor;
+        width = resolution[0] / scaling_factor;
+        height = resolution[1] / scaling_factor;
         draw_data.screen_x = 0;
         draw_data.screen_y = 0;
         draw_data.indicator_x = width / 2;
@@ -1123,7 +1616,7 @@ void render_lock(uint32_t *resolution, xcb_drawable_t drawable) {
         draw_data.keylayout_text.y = te_eval(te_layout_y_expr);
         draw_data.greeter_text.x = te_eval(te_greeter_x_expr);
         draw_data.greeter_text.y = te_eval(te_greeter_y_expr);
-        switch (auth_state) {
+        switch (snap->auth_state) {
             case STATE_AUTH_VERIFY:
             case STATE_AUTH_LOCK:
                 draw_data.status_text.x = te_eval(te_verif_x_expr);
@@ -1170,7 +1663,10 @@ void render_lock(uint32_t *resolution, xcb_drawable_t drawable) {
         DEBUG("Status at %fx%f\n", draw_data.status_text.x, draw_data.status_text.y);
         DEBUG("Mod at %fx%f\n", draw_data.mod_text.x, draw_data.mod_text.y);
 
-        draw_elements(ctx, &draw_data);
+        prepare_draw_data(snap, &draw_data, heights);
+        add_indicator_bounds(&draw_data, scaling_factor);
+        add_clock_texts(&draw_data, scaling_factor);
+        draw_elements(ctx, snap, &draw_data);
     }
 
     te_free(te_ind_x_expr);
@@ -1195,90 +1691,350 @@ void render_lock(uint32_t *resolution, xcb_drawable_t drawable) {
     te_free(te_greeter_x_expr);
     te_free(te_greeter_y_expr);
 
-    cairo_set_source_surface(xcb_ctx, output, 0, 0);
-    cairo_rectangle(xcb_ctx, 0, 0, resolution[0], resolution[1]);
-    cairo_fill(xcb_ctx);
+    if (tiled) {
+        for (int i = 0; i < snap->screen_count; i++) {
+            if (!tiles[i].surface)
+                continue;
+            const Rect *rect = &snap->screens[i];
+            cairo_set_source_surface(xcb_ctx, tiles[i].surface, rect->x, rect->y);
+            cairo_rectangle(xcb_ctx, rect->x, rect->y, rect->width, rect->height);
+            cairo_fill(xcb_ctx);
+            cairo_surface_destroy(tiles[i].surface);
+        }
+    } else {
+        cairo_set_source_surface(xcb_ctx, output, area.x, area.y);
+        cairo_rectangle(xcb_ctx, area.x, area.y, area.width, area.height);
+        cairo_fill(xcb_ctx);
+
+        cairo_surface_destroy(output);
+        cairo_destroy(ctx);
+    }
 
+    free(tiles);
+    free(heights);
     cairo_surface_destroy(xcb_output);
-    cairo_surface_destroy(output);
-    cairo_destroy(ctx);
     cairo_destroy(xcb_ctx);
 }
 
-/**
- * Draws the configured image on the provided context. The image is drawn centered on all monitors, tiled, or just
- * painted starting from 0,0. It is also scaled if bg_type is FILL, MAX, or SCALE.
+/*
+ * Renders the lock screen on the provided drawable with the given resolution.
+ * This draws on the calling thread, so it is only used for the first frame,
+ * before the redraw thread is started. Later redraws use redraw_screen().
  */
-void draw_image(uint32_t* root_resolution, cairo_surface_t *img, cairo_t* xcb_ctx) {
+void render_lock(uint32_t *resolution, xcb_drawable_t drawable) {
+    draw_snapshot_t snap;
+    capture_draw_snapshot(&snap);
+    snap.resolution[0] = resolution[0];
+    snap.resolution[1] = resolution[1];
+    stamp_clock(&snap);
+    render_snapshot(&snap, drawable);
+    release_draw_snapshot(&snap);
+}
 
-    if (bg_type == NONE) {
-        // Don't do any image manipulation
-        cairo_set_source_surface(xcb_ctx, img, 0, 0);
-        cairo_paint(xcb_ctx);
+/*
+ * Update image according to the slideshow_interval. This replaces img, so it
+ * must only be called from the main thread.
+ */
+static void update_slideshow(void) {
+    if (slideshow_image_count <= 0)
         return;
+
+    unsigned long now = (unsigned long)time(NULL);
+    if (img == NULL || now - lastCheck >= slideshow_interval) {
+        if (slideshow_random_selection) {
+            img = load_image(img_slideshow[rand() % slideshow_image_count]);
+        } else {
+            img = load_image(img_slideshow[current_slideshow_index]);
+        }
+        current_slideshow_index++;
+        if (current_slideshow_index >= slideshow_image_count) {
+            current_slideshow_index = 0;
+            load_slideshow_images(slideshow_path);
+        }
+        lastCheck = now;
+    }
+}
+
+/*
+ * Copies the current lock state into snap. Must be called from the main
+ * thread. The snapshot holds its own copy of the screen layout and references
+ * to the images, free them with release_draw_snapshot().
+ */
+void capture_draw_snapshot(draw_snapshot_t *snap) {
+    memset(snap, 0, sizeof(draw_snapshot_t));
+
+    update_slideshow();
+
+    snap->unlock_state = unlock_state;
+    snap->auth_state = auth_state;
+    snap->failed_attempts = failed_attempts;
+
+    if (modifier_string) {
+        snap->show_modifier = true;
+        strncpy(snap->modifier_text, modifier_string, sizeof(snap->modifier_text) - 1);
+    }
+    if (layout_text) {
+        snap->show_layout = true;
+        strncpy(snap->layout_text, layout_text, sizeof(snap->layout_text) - 1);
     }
 
-    cairo_pattern_t *pattern = cairo_pattern_create_for_surface(img);
-    cairo_pattern_set_extend(pattern, bg_type == TILE ? CAIRO_EXTEND_REPEAT : CAIRO_EXTEND_NONE);
-    cairo_set_source(xcb_ctx, pattern);
+    snap->resolution[0] = last_resolution[0];
+    snap->resolution[1] = last_resolution[1];
 
-    double image_width = cairo_image_surface_get_width(img);
-    double image_height = cairo_image_surface_get_height(img);
+    if (xr_screens > 0 && (snap->screens = malloc(xr_screens * sizeof(Rect))) != NULL) {
+        memcpy(snap->screens, xr_resolutions, xr_screens * sizeof(Rect));
+        snap->screen_count = xr_screens;
+    }
+    snap->screen_number = screen_number;
+    if (snap->screen_number < 0 || snap->screen_number > snap->screen_count)
+        snap->screen_number = 0;
 
-    for (int i = 0; i < xr_screens; i++) {
-        // Find out scaling factors using bg_type and aspect ratios
-        double scale_x = 1, scale_y = 1;
-        if (bg_type == SCALE) {
-            scale_x = xr_resolutions[i].width / image_width;
-            scale_y = xr_resolutions[i].height / image_height;
-
-        } else if (bg_type == MAX || bg_type == FILL) {
-            double aspect_diff = (double) xr_resolutions[i].height / xr_resolutions[i].width - image_height / image_width;
-            if((bg_type == MAX && aspect_diff >= 0) || (bg_type == FILL && aspect_diff <= 0)) {
-                scale_x = scale_y = xr_resolutions[i].width / image_width;
-            } else if ((bg_type == MAX && aspect_diff < 0) || (bg_type == FILL && aspect_diff > 0)) {
-                scale_x = scale_y = xr_resolutions[i].height / image_height;
-            }
-        }
+    /* Looked up here so that rendering never writes to globals */
+    if (!vistype)
+        vistype = get_visualtype_by_depth(32, screen);
 
-        // Scale and translate the pattern
-        cairo_matrix_t matrix;
-        cairo_matrix_init_scale(&matrix, 1/scale_x, 1/scale_y);
+    if (img)
+        snap->img = cairo_surface_reference(img);
+    if (blur_bg_img)
+        snap->bg_img = cairo_surface_reference(blur_bg_img);
+}
 
-        if (bg_type == TILE) {
-            // Start image from top-left corner
-            cairo_matrix_translate(&matrix, -xr_resolutions[i].x, -xr_resolutions[i].y);
-        } else {
-            // Draw image in the center of the screen
-            cairo_matrix_translate(&matrix,
-                (image_width  * scale_x - xr_resolutions[i].width ) / 2 - xr_resolutions[i].x,
-                (image_height * scale_y - xr_resolutions[i].height) / 2 - xr_resolutions[i].y);
-        }
+void release_draw_snapshot(draw_snapshot_t *snap) {
+    free(snap->screens);
+    snap->screens = NULL;
+    snap->screen_count = 0;
+
+    if (snap->img)
+        cairo_surface_destroy(snap->img);
+    snap->img = NULL;
+    if (snap->bg_img)
+        cairo_surface_destroy(snap->bg_img);
+    snap->bg_img = NULL;
+}
 
-        cairo_pattern_set_matrix(pattern, &matrix);
+/* The pixmap of the last presented snapshot, kept so that damaged snapshots
+ * only need to redraw the parts that changed. */
+static xcb_pixmap_t presented_pixmap = XCB_NONE;
+static uint32_t presented_resolution[2];
+
+/* The parts of the last presented snapshot the indicator and texts show. */
+static struct {
+    unlock_state_t unlock_state;
+    auth_state_t auth_state;
+    int failed_attempts;
+    bool show_modifier;
+    char modifier_text[512];
+    bool show_layout;
+    char layout_text[512];
+    char time_text[40];
+    char date_text[40];
+} presented_state;
+
+static void remember_presented_state(const draw_snapshot_t *snap) {
+    presented_state.unlock_state = snap->unlock_state;
+    presented_state.auth_state = snap->auth_state;
+    presented_state.failed_attempts = snap->failed_attempts;
+    presented_state.show_modifier = snap->show_modifier;
+    memcpy(presented_state.modifier_text, snap->modifier_text, sizeof(presented_state.modifier_text));
+    presented_state.show_layout = snap->show_layout;
+    memcpy(presented_state.layout_text, snap->layout_text, sizeof(presented_state.layout_text));
+    memcpy(presented_state.time_text, snap->time_text, sizeof(presented_state.time_text));
+    memcpy(presented_state.date_text, snap->date_text, sizeof(presented_state.date_text));
+}
 
-        // Draw to screen
-        cairo_rectangle(xcb_ctx, xr_resolutions[i].x, xr_resolutions[i].y, xr_resolutions[i].width, xr_resolutions[i].height);
-        cairo_fill(xcb_ctx);
+/* The unlock states that show the indicator with the same texts, which only
+ * differ in the keypress highlight. */
+static bool highlight_state(unlock_state_t state) {
+    return state == STATE_KEY_PRESSED || state == STATE_KEY_ACTIVE || state == STATE_BACKSPACE_ACTIVE;
+}
+
+/* Appends rect to the damage of snap. Returns false if there is no room. */
+static bool add_damage(draw_snapshot_t *snap, const cairo_rectangle_int_t *rect) {
+    if (snap->damage_count == MAX_DAMAGE_RECTS)
+        return false;
+    snap->damage[snap->damage_count++] = *rect;
+    return true;
+}
+
+/*
+ * Adds where the clock was and where it will be to the damage of snap, if it
+ * changed since the last presented snapshot. The clock texts stay where the
+ * last render put them, only their width changes. Returns false if the whole
+ * screen has to be redrawn instead.
+ */
+static bool add_clock_damage(draw_snapshot_t *snap) {
+    if (strcmp(snap->time_text, presented_state.time_text) == 0 &&
+        strcmp(snap->date_text, presented_state.date_text) == 0)
+        return true;
+
+    cairo_t *ctx = create_measuring_context(clock_scaling_factor);
+
+    bool ok = true;
+    for (int i = 0; ok && i < clock_text_count; i++) {
+        const text_t *text = &clock_texts[i];
+        const char *next = i % 2 == 0 ? snap->time_text : snap->date_text;
+        /* hidden behind a status text */
+        if (!text->font)
+            continue;
+
+        cairo_rectangle_int_t bounds;
+        if (text->show)
+            ok = text_bounds(ctx, text, text->str, clock_scaling_factor, &bounds) && add_damage(snap, &bounds);
+        if (ok && *next)
+            ok = text_bounds(ctx, text, next, clock_scaling_factor, &bounds) && add_damage(snap, &bounds);
     }
 
-    cairo_pattern_destroy(pattern);
+    cairo_destroy(ctx);
+    return ok;
+}
+
+/*
+ * Adds what changed about the indicator since the last presented snapshot to
+ * the damage of snap. The keypress highlight only changes the indicator, and
+ * the bars change with every render, so their bounding boxes are enough; the
+ * clock is measured, see add_clock_damage(). Other texts can be anywhere, so
+ * if one changed, everything is redrawn.
+ */
+static void add_indicator_damage(draw_snapshot_t *snap) {
+    const bool same_texts = snap->auth_state == presented_state.auth_state &&
+                            snap->failed_attempts == presented_state.failed_attempts &&
+                            snap->show_modifier == presented_state.show_modifier &&
+                            strcmp(snap->modifier_text, presented_state.modifier_text) == 0 &&
+                            snap->show_layout == presented_state.show_layout &&
+                            strcmp(snap->layout_text, presented_state.layout_text) == 0 &&
+                            (snap->unlock_state == presented_state.unlock_state ||
+                             (highlight_state(snap->unlock_state) && highlight_state(presented_state.unlock_state)));
+    if (!same_texts || !add_clock_damage(snap)) {
+        snap->damage_count = 0;
+        return;
+    }
+    if (snap->unlock_state == presented_state.unlock_state && !bar_enabled)
+        return;
+
+    if (snap->damage_count + indicator_bounds_count > MAX_DAMAGE_RECTS) {
+        snap->damage_count = 0;
+        return;
+    }
+    memcpy(&snap->damage[snap->damage_count], indicator_bounds, indicator_bounds_count * sizeof(cairo_rectangle_int_t));
+    snap->damage_count += indicator_bounds_count;
 }
 
 /*
- * Calls render_lock on a new pixmap and swaps that with the current pixmap
+ * Calls render_snapshot on a new pixmap and swaps that with the current pixmap.
+ * Snapshots with damage are rendered into the current pixmap instead, and only
+ * the damaged areas of the window (plus the indicator, if it changed) are
+ * refreshed.
  *
  */
-void redraw_screen(void) {
-    DEBUG("redraw_screen(unlock_state = %d, auth_state = %d) @ [%lu]\n", unlock_state, auth_state, (unsigned long)time(NULL));
-    xcb_pixmap_t pixmap = create_bg_pixmap(conn, win, last_resolution, color);
-    render_lock(last_resolution, pixmap);
+static void present_snapshot(draw_snapshot_t *snap) {
+    uint32_t resolution[2] = {snap->resolution[0], snap->resolution[1]};
+
+    stamp_clock(snap);
+    if (snap->damage_count > 0)
+        add_indicator_damage(snap);
+    remember_presented_state(snap);
+
+    if (snap->damage_count > 0 && presented_pixmap != XCB_NONE &&
+        presented_resolution[0] == resolution[0] && presented_resolution[1] == resolution[1]) {
+        render_snapshot(snap, presented_pixmap);
+        /* The server may have copied the background, so set it again. */
+        xcb_change_window_attributes(conn, win, XCB_CW_BACK_PIXMAP, (uint32_t[1]){presented_pixmap});
+        for (int i = 0; i < snap->damage_count; i++) {
+            const cairo_rectangle_int_t *r = &snap->damage[i];
+            xcb_clear_area(conn, 0, win, r->x, r->y, r->width, r->height);
+        }
+        xcb_flush(conn);
+        return;
+    }
+
+    xcb_pixmap_t pixmap = create_bg_pixmap(conn, win, resolution, color);
+    render_snapshot(snap, pixmap);
     xcb_change_window_attributes(conn, win, XCB_CW_BACK_PIXMAP, (uint32_t[1]){pixmap});
-    xcb_clear_area(conn, 0, win, 0, 0, last_resolution[0], last_resolution[1]);
-    xcb_free_pixmap(conn, pixmap);
+    xcb_clear_area(conn, 0, win, 0, 0, resolution[0], resolution[1]);
+    if (presented_pixmap != XCB_NONE)
+        xcb_free_pixmap(conn, presented_pixmap);
+    presented_pixmap = pixmap;
+    presented_resolution[0] = resolution[0];
+    presented_resolution[1] = resolution[1];
     xcb_flush(conn);
 }
 
+/*
+ * Hands a new snapshot to the redraw thread, replacing any snapshot it has
+ * not picked up yet. If rect is not NULL, only that part of the image surface
+ * changed.
+ *
+ */
+static void publish_draw_snapshot(cairo_surface_t *surface, const cairo_rectangle_int_t *rect) {
+    draw_snapshot_t snap;
+    capture_draw_snapshot(&snap);
+    if (rect)
+        snap.damage_count = image_damage(&snap, surface, rect, snap.damage);
+
+    pthread_mutex_lock(&snapshot_mutex);
+    if (snapshot_pending) {
+        /* The replaced snapshot was not drawn, so its damage still is. */
+        if (snap.damage_count > 0 && pending_snapshot.damage_count > 0 &&
+            snap.damage_count + pending_snapshot.damage_count <= MAX_DAMAGE_RECTS) {
+            memcpy(&snap.damage[snap.damage_count], pending_snapshot.damage,
+                   pending_snapshot.damage_count * sizeof(cairo_rectangle_int_t));
+            snap.damage_count += pending_snapshot.damage_count;
+        } else {
+            snap.damage_count = 0;
+        }
+        /* Don't lose a keypress highlight the redraw thread has not drawn
+         * yet just because the main loop already went back to
+         * STATE_KEY_PRESSED. */
+        if (snap.unlock_state == STATE_KEY_PRESSED &&
+            (pending_snapshot.unlock_state == STATE_KEY_ACTIVE ||
+             pending_snapshot.unlock_state == STATE_BACKSPACE_ACTIVE))
+            snap.unlock_state = pending_snapshot.unlock_state;
+        release_draw_snapshot(&pending_snapshot);
+    }
+    pending_snapshot = snap;
+    snapshot_pending = true;
+    pthread_cond_signal(&snapshot_cond);
+    pthread_mutex_unlock(&snapshot_mutex);
+}
+
+/*
+ * Redraws the screen with the current lock state. With --redraw-thread, the
+ * drawing (and all X11 requests it involves) happens on the redraw thread.
+ *
+ */
+void redraw_screen(void) {
+    DEBUG("redraw_screen(unlock_state = %d, auth_state = %d) @ [%lu]\n", unlock_state, auth_state, (unsigned long)time(NULL));
+    if (redraw_thread_running) {
+        publish_draw_snapshot(NULL, NULL);
+        return;
+    }
+
+    draw_snapshot_t snap;
+    capture_draw_snapshot(&snap);
+    present_snapshot(&snap);
+    release_draw_snapshot(&snap);
+}
+
+/*
+ * Like redraw_screen(), but only the part of the screen showing the given
+ * rectangle of the image surface (in image pixels) is redrawn. Used when just
+ * a part of the image changed, like between the frames of an animation. If
+ * the slideshow replaced the image meanwhile, everything is redrawn.
+ *
+ */
+void redraw_image_region(cairo_surface_t *surface, const cairo_rectangle_int_t *rect) {
+    if (redraw_thread_running) {
+        publish_draw_snapshot(surface, rect);
+        return;
+    }
+
+    draw_snapshot_t snap;
+    capture_draw_snapshot(&snap);
+    snap.damage_count = image_damage(&snap, surface, rect, snap.damage);
+    present_snapshot(&snap);
+    release_draw_snapshot(&snap);
+}
+
 /*
  * Hides the unlock indicator completely when there is no content in the
  * password buffer.
@@ -1292,11 +2048,79 @@ void clear_indicator(void) {
     redraw_screen();
 }
 
+/*
+ * How long past a clock tick the redraw thread waits for the main loop's
+ * snapshot before it concludes the main loop is blocked and re-renders on its
+ * own (at most a quarter of the refresh interval).
+ *
+ */
+#define REDRAW_TICK_SLACK 0.1
+
+/*
+ * Sets deadline to shortly after the next multiple of interval on the
+ * realtime clock. The ev_periodic clock tick of the main loop fires on that
+ * multiple and publishes a snapshot, so the thread only reaches the deadline
+ * while the main loop is blocked. Taking absolute times keeps rendering time
+ * from adding up as drift.
+ *
+ */
+static void next_redraw_tick(const struct timespec *interval, struct timespec *deadline) {
+    clock_gettime(CLOCK_REALTIME, deadline);
+    const double period = interval->tv_sec + (double)interval->tv_nsec / NANOSECONDS_IN_SECOND;
+    if (period <= 0)
+        return;
+
+    const double slack = period / 4 < REDRAW_TICK_SLACK ? period / 4 : REDRAW_TICK_SLACK;
+    const double now = deadline->tv_sec + (double)deadline->tv_nsec / NANOSECONDS_IN_SECOND;
+    const double next = (floor(now / period) + 1) * period + slack;
+    deadline->tv_sec = (time_t)next;
+    deadline->tv_nsec = (long)((next - deadline->tv_sec) * NANOSECONDS_IN_SECOND);
+    if (deadline->tv_nsec >= NANOSECONDS_IN_SECOND) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= NANOSECONDS_IN_SECOND;
+    }
+}
+
+/*
+ * Body of the redraw thread. Renders every snapshot published by the main
+ * loop, and re-renders the latest one whenever no new snapshot arrived
+ * shortly after the next clock tick (e.g. while PAM blocks the main loop), so
+ * the clock and bar keep updating without rendering each tick twice.
+ *
+ */
 void *start_time_redraw_tick_pthread(void *arg) {
-    struct timespec *ts = (struct timespec *)arg;
+    const struct timespec interval = *(struct timespec *)arg;
+    draw_snapshot_t snap;
+    bool have_snapshot = false;
+    memset(&snap, 0, sizeof(draw_snapshot_t));
+
     while (1) {
-        nanosleep(ts, NULL);
-        redraw_screen();
+        struct timespec deadline;
+        next_redraw_tick(&interval, &deadline);
+
+        pthread_mutex_lock(&snapshot_mutex);
+        while (!snapshot_pending) {
+            if (pthread_cond_timedwait(&snapshot_cond, &snapshot_mutex, &deadline) == ETIMEDOUT)
+                break;
+        }
+        if (snapshot_pending) {
+            release_draw_snapshot(&snap);
+            snap = pending_snapshot;
+            snapshot_pending = false;
+            have_snapshot = true;
+        }
+        pthread_mutex_unlock(&snapshot_mutex);
+
+        if (!have_snapshot)
+            continue;
+
+        present_snapshot(&snap);
+        /* Re-renders on timeout draw everything, the damage is done. */
+        snap.damage_count = 0;
+
+        /* The main loop only shows a keypress highlight once, too. */
+        if (snap.unlock_state == STATE_KEY_ACTIVE || snap.unlock_state == STATE_BACKSPACE_ACTIVE)
+            snap.unlock_state = STATE_KEY_PRESSED;
     }
     return NULL;
 }
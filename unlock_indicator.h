@@ -5,6 +5,7 @@
 #include <xcb/xcb.h>
 
 #include <fonts.h>
+#include "randr.h"
 
 typedef enum {
     STATE_STARTED = 0,           /* default state */
@@ -36,8 +37,50 @@ typedef struct {
 
     double screen_x, screen_y;
     double bar_x, bar_y, bar_width;
+
+    /* per-screen animation state, fixed before drawing */
+    double highlight_start;
+    const double *bar_heights;
 } DrawData;
 
+/* at most this many rectangles are redrawn separately, see redraw_image_region() */
+#define MAX_DAMAGE_RECTS 16
+
+/*
+ * Everything render_lock() needs to know about the current lock state, copied
+ * out of the globals the event loop mutates. The redraw thread only ever looks
+ * at snapshots, never at the live globals.
+ */
+typedef struct {
+    unlock_state_t unlock_state;
+    auth_state_t auth_state;
+    int failed_attempts;
+
+    bool show_modifier;
+    char modifier_text[512];
+    bool show_layout;
+    char layout_text[512];
+
+    uint32_t resolution[2];
+    int screen_count;
+    Rect *screens;
+    /* the screen to draw the indicator on (1-based), or 0 for all screens */
+    int screen_number;
+
+    cairo_surface_t *img;
+    /* the blurred screen, or NULL for a plain background */
+    cairo_surface_t *bg_img;
+
+    /* the clock as of drawing, set by present_snapshot() */
+    char time_text[40];
+    char date_text[40];
+
+    /* If damage_count is not 0, only these rectangles (in screen pixels)
+     * changed since the last snapshot that was presented. */
+    int damage_count;
+    cairo_rectangle_int_t damage[MAX_DAMAGE_RECTS];
+} draw_snapshot_t;
+
 typedef enum {
     NONE,
     TILE,
@@ -64,11 +107,14 @@ typedef struct {
 } control_char_config_t;
 
 void render_lock(uint32_t* resolution, xcb_drawable_t drawable);
-void draw_image(uint32_t* resolution, cairo_surface_t* img, cairo_t* xcb_ctx);
+void draw_image(const draw_snapshot_t* snap, cairo_surface_t* img, cairo_t* xcb_ctx);
 void init_colors_once(void);
 void redraw_screen(void);
+void redraw_image_region(cairo_surface_t *surface, const cairo_rectangle_int_t *rect);
 void clear_indicator(void);
 void start_time_redraw_timeout(void);
 void* start_time_redraw_tick_pthread(void* arg);
 void start_time_redraw_tick(struct ev_loop* main_loop);
+void capture_draw_snapshot(draw_snapshot_t* snap);
+void release_draw_snapshot(draw_snapshot_t* snap);
 #endif